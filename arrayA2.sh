@@ -1,9 +1,10 @@
 #!/bin/bash
 
-echo cs241.binasm '<' $1.asm '>' $1.mips
-cs241.binasm < $1.asm > $1.mips
+dir=$(dirname "$0")
+echo asm '<' $1.asm '>' $1.mips
+"$dir"/asm < $1.asm > $1.mips
 if [ $? -eq 0 ]
   then
-    echo mips.array $1.mips
-    mips.array $1.mips
+    echo emu --array $1.mips
+    "$dir"/emu --array $1.mips
 fi
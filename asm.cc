@@ -1,9 +1,18 @@
 #include <iostream>
-#include <sstream>
-#include <limits.h>
-#include <algorithm>
-#include <map> 
+#include <iomanip>
+#include <fstream>
+#include <memory>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
 #include "scanner.h"
+#include "input.h"
+#include "output.h"
+#include "assembler.h"
+#include "cache.h"
+#include "server.h"
 using namespace std;
 
 /*
@@ -11,531 +20,402 @@ using namespace std;
  * All code requires C++14, so if you're getting compile errors make sure to
  * use -std=c++14.
  *
- * This file contains the main function of your program. By default, it just
- * prints the scanned list of tokens back to standard output.
+ * This file contains the main function of your program. The assembler
+ * itself is the Assembler class (see assembler.h); this is just its
+ * command line.
+ *
+ * Usage: asm [-o file] [-j threads] [--merl] < program.asm
+ * The machine code goes to standard output, or to file if -o is given.
+ * With --merl it is a relocatable MERL object (see merl.h) instead, and
+ * the program may use .import and .export.
+ *
+ * With --relax $r, a beq or bne whose target is too far away is rewritten
+ * as a branch with the opposite condition around lis $r, .word target and
+ * jr $r, instead of being an error. $r is overwritten by these.
+ *
+ * Besides instructions, the program may contain data:
+ *   .word a, b, ...   one word for each operand, a number or a label
+ *   .space n          n zero bytes, where n is a multiple of 4
+ *   .fill n, v        n words holding v
+ *   .incbin "file"    the contents of file, read as big-endian words
+ *
+ * With --cache dir, results are kept in dir (see cache.h), up to
+ * --cache-size megabytes of them, and reused when the same program is
+ * assembled again. asm --cache dir --cache-stats reports on the cache.
+ * Large programs are assembled on several threads (one per hardware
+ * thread unless -j says otherwise); the result is the same either way.
+ *
+ * --stats reports, after the symbol table, the time and allocations each
+ * phase of assembling took (see AssemblerStats), along with counts of
+ * what was assembled and the peak resident memory. --stats=json reports
+ * the same on one line, as a JSON object whose keys never change meaning;
+ * fields may be added, with a new "version", but are never removed.
+ *
+ * asm --batch a.asm b.asm ... assembles each file into a.mips (or a.merl)
+ * and its symbol table into a.sym, and so on, reporting errors as
+ * "file:line: ERROR ..." and carrying on with the next file. With no
+ * files, their paths are read from standard input, one per line.
+ *
+ * asm --serve sock stays running, assembling programs sent to the Unix
+ * domain socket sock (see protocol.h) by asmc, which otherwise works just
+ * like asm, on -j threads. .incbin is an error in programs sent to it,
+ * since it would read files with the server's access for anyone who can
+ * connect to sock, unless the server is started with --allow-incbin; its
+ * paths are then relative to the server's working directory.
  */
 
-// Stores the token's lexeme in label and the pc value of its
-// instruction for the third token in beq and bne which is a label
-struct iLabel {
-  string label;
-  int pc;
-};
+// Returns a string identifying this build of the assembler, so that
+// results cached by any other build are never used
+string assemblerBuild() {
+  string build = "cs241 asm " __DATE__ " " __TIME__;
+  struct stat info;
+  if (stat("/proc/self/exe", &info) == 0) {
+    build += " " + to_string(info.st_size) + " "
+      + to_string(info.st_mtim.tv_sec) + "."
+      + to_string(info.st_mtim.tv_nsec);
+  }
+  return build;
+}
 
-// Outputs the assembled statement byte by byte using chars
-void outputBytes(int instr) {
-  char c = instr >> 24;
-  cout << c;
-  c = instr >> 16;
-  cout << c;
-  c = instr >> 8;
-  cout << c;
-  c = instr;
-  cout << c;
+// Prints the statistics of cache to stdout
+void outputCacheStats(const string &dir, AssemblyCache &cache) {
+  AssemblyCache::Stats stats = cache.stats();
+  uint64_t lookups = stats.hits + stats.misses;
+  cout << "cache " << dir << "\n"
+    << "entries " << stats.entries << "\n"
+    << "bytes " << stats.bytes << "\n"
+    << "limit " << stats.limit << "\n"
+    << "hits " << stats.hits << "\n"
+    << "misses " << stats.misses << "\n"
+    << "evictions " << stats.evictions << "\n"
+    << "hit rate "
+    << (lookups == 0 ? 0 : 100 * stats.hits / lookups) << "%" << endl;
 }
 
-// Returns the integer representation of instruction instrType 
-// with operands op1 (op2 and op3) using bit shit and binary op.
-int assembleInstr(
-  string instrType, int64_t op1, int64_t op2, int64_t op3) {
-  int instr;
-  if (instrType == ".word") {
-    instr = op1;
-  } else if (instrType == "jr") {
-    instr = (op1 << 21) | 8;
-  } else if (instrType == "jalr") {
-    instr = (op1 << 21) | 9;
-  } else if (instrType == "add") {
-    instr = (op1 << 11) | (op2 << 21) | (op3 << 16) | 32;
-  } else if (instrType == "sub") {
-    instr = (op1 << 11) | (op2 << 21) | (op3 << 16) | 34;
-  } else if (instrType == "slt") {
-    instr = (op1 << 11) | (op2 << 21) | (op3 << 16) | 42;
-  } else if (instrType == "sltu") {
-    instr = (op1 << 11) | (op2 << 21) | (op3 << 16) | 43;
-  } else if (instrType == "beq") {
-    instr = (op1 << 21) | (op2 << 16) | (op3 & 0xffff) | (4 << 26);
-  } else if (instrType == "bne") {
-    instr = (op1 << 21) | (op2 << 16) | (op3 & 0xffff) | (5 << 26);
-  } else if (instrType == "lis") {
-    instr = (op1 << 11) | 20;
-  } else if (instrType == "mfhi") {
-    instr = (op1 << 11) | 16;
-  } else if (instrType == "mflo") {
-    instr = (op1 << 11) | 18;
-  } else if (instrType == "mult") {
-    instr = (op1 << 21) | (op2 << 16) | 24;
-  } else if (instrType == "multu") {
-    instr = (op1 << 21) | (op2 << 16) | 25;
-  } else if (instrType == "div") {
-    instr = (op1 << 21) | (op2 << 16) | 26;
-  } else if (instrType == "divu") {
-    instr = (op1 << 21) | (op2 << 16) | 27;
-  } else if (instrType == "sw") {
-    instr = (op1 << 16) | (op2 & 0xffff) | (op3 << 21) | (43 << 26);
-  } else if (instrType == "lw") {
-    instr = (op1 << 16) | (op2 & 0xffff) | (op3 << 21) | (35 << 26);
+// Prints stats to stderr, as a table or as JSON. cached says whether the
+// program came from the cache instead, in which case stats are all zero.
+void outputStats(const AssemblerStats &stats, bool cached, bool json) {
+  const uint64_t peak = peakResidentBytes();
+  if (json) {
+    auto phase = [](const PhaseStats &phase) {
+      return "{\"wall_us\":" + to_string(phase.wallMicros)
+        + ",\"cpu_us\":" + to_string(phase.cpuMicros)
+        + ",\"allocations\":" + to_string(phase.allocations)
+        + ",\"allocated_bytes\":" + to_string(phase.allocatedBytes) + "}";
+    };
+    cerr << "{\"version\":1,\"cached\":" << (cached ? "true" : "false")
+      << ",\"chunks\":" << stats.chunks
+      << ",\"tokens\":" << stats.tokens
+      << ",\"lines\":" << stats.lines
+      << ",\"labels\":" << stats.labels
+      << ",\"fixups\":" << stats.fixups
+      << ",\"bytes\":" << stats.bytes
+      << ",\"peak_rss_bytes\":" << peak
+      << ",\"phases\":{";
+    for (int i = 0; i < AssemblerStats::numPhases; ++i) {
+      cerr << (i == 0 ? "" : ",") << "\"" << AssemblerStats::phaseNames[i]
+        << "\":" << phase(stats.phases[i]);
+    }
+    cerr << "},\"total\":" << phase(stats.total) << "}" << endl;
+    return;
   }
-  return instr;
-}
 
-// Outputs the symbol table stored in labels to stderr
-void outputSymbolTable(map<string, int> labels) {
-  for (auto label : labels) {
-    cerr << label.first << " " << label.second << endl;
+  auto row = [](const string &name, const PhaseStats &phase) {
+    cerr << left << setw(8) << name << right << fixed << setprecision(3)
+      << setw(12) << phase.wallMicros / 1000.0
+      << setw(12) << phase.cpuMicros / 1000.0
+      << setw(13) << phase.allocations
+      << setw(16) << phase.allocatedBytes << "\n";
+  };
+  cerr << "phase        wall ms      cpu ms  allocations  allocated bytes\n";
+  for (int i = 0; i < AssemblerStats::numPhases; ++i) {
+    row(AssemblerStats::phaseNames[i], stats.phases[i]);
   }
+  row("total", stats.total);
+  cerr << (cached ? "cached\n" : "")
+    << "chunks " << stats.chunks << "\n"
+    << "tokens " << stats.tokens << "\n"
+    << "lines " << stats.lines << "\n"
+    << "labels " << stats.labels << "\n"
+    << "fixups " << stats.fixups << "\n"
+    << "bytes " << stats.bytes << "\n"
+    << "peak rss " << peak << endl;
 }
 
-// Return a vector denoting valid types of operands for 
-// instruction lexeme, each element of the vector is a
-//  vector of the possible operand types at that position
-vector<vector<Token::Kind>> setTypes(string lexeme) {
-  vector<Token::Kind> op1Types;
-  vector<Token::Kind> op2Types;
-  vector<Token::Kind> op3Types;
-  vector<Token::Kind> op4Types;
-  vector<Token::Kind> op5Types;
-  vector<Token::Kind> op6Types;
-  vector<vector<Token::Kind>> operandTypes;
-  if (lexeme == ".word" || lexeme == "jalr") {
-    op1Types.push_back(Token::INT);
-    op1Types.push_back(Token::HEXINT);
-    op1Types.push_back(Token::ID);
-    operandTypes.push_back(op1Types);
-  }
-  else if (lexeme == "jr" || lexeme == "jalr") {
-    op1Types.push_back(Token::REG);
-    operandTypes.push_back(op1Types);
+// Assembles the size bytes at source into result, or takes result from
+// cache if it is there (and stores it otherwise), setting cached to say
+// which. Returns false if the program has errors, which are left in
+// assembler.
+bool assembleCached(Assembler &assembler, AssemblyCache *cache,
+    const string &salt, const char *source, size_t size,
+    AssemblyCache::Entry &result, bool &cached) {
+  string key;
+  cached = false;
+  // The key only covers the source, not the files it includes
+  if (cache != nullptr && memmem(source, size, ".incbin", 7) == nullptr) {
+    key = AssemblyCache::key(salt, source, size);
+    if (cache->lookup(key, result)) {
+      cached = true;
+      return true;
+    }
   }
-  else if (lexeme == "add" || lexeme == "sub"
-      || lexeme == "slt" || lexeme == "sltu") {
-    op1Types.push_back(Token::REG);
-    op2Types.push_back(Token::COMMA);
-    op3Types.push_back(Token::REG);
-    op4Types.push_back(Token::COMMA);
-    op5Types.push_back(Token::REG);
-    operandTypes.push_back(op1Types);
-    operandTypes.push_back(op2Types);
-    operandTypes.push_back(op3Types);
-    operandTypes.push_back(op4Types);
-    operandTypes.push_back(op5Types);
+
+  if (!assembler.assemble(source, size)) {
+    return false;
   }
-  else if (lexeme == "beq" || lexeme == "bne") {
-    op1Types.push_back(Token::REG);
-    op2Types.push_back(Token::COMMA);
-    op3Types.push_back(Token::REG);
-    op4Types.push_back(Token::COMMA);
-    op5Types.push_back(Token::INT);
-    op5Types.push_back(Token::HEXINT);
-    op5Types.push_back(Token::ID);
-    operandTypes.push_back(op1Types);
-    operandTypes.push_back(op2Types);
-    operandTypes.push_back(op3Types);
-    operandTypes.push_back(op4Types);
-    operandTypes.push_back(op5Types);
-  } else if (lexeme == "lis" || lexeme == "mfhi" || lexeme == "mflo") {
-    op1Types.push_back(Token::REG);
-    operandTypes.push_back(op1Types);
-  } else if (lexeme == "mult" || lexeme == "multu" || 
-    lexeme == "div" || lexeme == "divu") {
-    op1Types.push_back(Token::REG);
-    op2Types.push_back(Token::COMMA);
-    op3Types.push_back(Token::REG);
-    operandTypes.push_back(op1Types);
-    operandTypes.push_back(op2Types);
-    operandTypes.push_back(op3Types);
-  } else if (lexeme == "lw" || lexeme == "sw") {
-    op1Types.push_back(Token::REG);
-    op2Types.push_back(Token::COMMA);
-    op3Types.push_back(Token::INT);
-    op3Types.push_back(Token::HEXINT);
-    op4Types.push_back(Token::LPAREN);
-    op5Types.push_back(Token::REG);
-    op6Types.push_back(Token::RPAREN);
-    operandTypes.push_back(op1Types);
-    operandTypes.push_back(op2Types);
-    operandTypes.push_back(op3Types);
-    operandTypes.push_back(op4Types);
-    operandTypes.push_back(op5Types);
-    operandTypes.push_back(op6Types);
+  result.words = assembler.words();
+  result.listing = assembler.listing();
+  if (!key.empty()) {
+    cache->store(key, result.words, result.listing);
   }
-  return operandTypes;
+  return true;
 }
 
-// Throws an error if Token tp is out of bound
-void checkBounds(Token *tp, int t = 0) {
-  Token::Kind kind = tp->getKind();
-  int64_t instr = tp->toLong();
-
-  if (t == 1) { // i in lw, sw, beq, bne
-    if (kind == Token::INT) {
-      if (instr > SHRT_MAX || instr < SHRT_MIN) {
-        throw ScanningFailure("ERROR: Constant out of bound.");
+// Assembles each file of paths beside it, as described above. Returns the
+// exit status: 1 if any file could not be assembled.
+int assembleBatch(Assembler &assembler, AssemblyCache *cache,
+    const string &salt, const vector<string> &paths, bool relocatable) {
+  int status = 0;
+  AssemblyCache::Entry result;
+  bool cached;
+  for (auto &path : paths) {
+    try {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        throw ScanningFailure("ERROR: Cannot read " + path);
       }
-    } else if (kind == Token::HEXINT) {
-      if (instr > USHRT_MAX) {
-        throw ScanningFailure("ERROR: Constant out of bound.");
+      unique_ptr<InputBuffer> input;
+      try {
+        input.reset(new InputBuffer(fd));
+      } catch (ScanningFailure &f) {
+        close(fd);
+        throw;
       }
-    } else if (kind == Token::REG) { 
-      if (instr > 31 || instr < 0) {
-        throw ScanningFailure("ERROR: Constant out of bound.");
+      close(fd);
+
+      if (!assembleCached(assembler, cache, salt, input->data(),
+          input->size(), result, cached)) {
+        for (auto &diagnostic : assembler.diagnostics()) {
+          cerr << path << ":";
+          if (diagnostic.line != 0) {
+            cerr << diagnostic.line << ":";
+          }
+          cerr << " " << diagnostic.message << endl;
+        }
+        status = 1;
+        continue;
       }
-    }
-  } else { // i after .word
-    if (kind == Token::INT || kind == Token::HEXINT) {
-      if (instr > UINT_MAX || instr < INT_MIN) {
-        throw ScanningFailure("ERROR: Constant out of bound.");
+
+      string base = path;
+      if (base.size() > 4 && base.compare(base.size() - 4, 4, ".asm") == 0) {
+        base.resize(base.size() - 4);
       }
-    } else if (kind == Token::REG) { 
-      if (instr > 31 || instr < 0) {
-        throw ScanningFailure("ERROR: Constant out of bound.");
+      string outputPath = base + (relocatable ? ".merl" : ".mips");
+      writeWordsToFile(outputPath.c_str(), result.words.data(),
+        result.words.size());
+      ofstream listing(base + ".sym");
+      listing << result.listing;
+      if (!listing.flush()) {
+        throw ScanningFailure("ERROR: Cannot write " + base + ".sym");
       }
     }
+    catch (ScanningFailure &f) {
+      cerr << path << ": " << f.what() << endl;
+      status = 1;
+    }
   }
+  return status;
 }
 
-int main() {
-  string line;
-  vector<int> outputQueue;         // queue of instructions  
-  vector<vector<Token>> prog;      // whole program in tokens
-  map<string, int> labels;         // map for symbol table
-  vector<string> operandLabels;    // all the labels that are operands
-  int pcValue = 0;
-  string label;                    // label without ":"
-  string operandLabel;             // label appears as an operand
-  Token prevToken = Token{Token::ID, "add"}; // random initialization value
-  vector<iLabel> labelPC;  // vector of vector<label, pc at label>
+// The socket of asm --serve, removed when the server is stopped
+const char *serverSocket = nullptr;
 
-  try {
-    while (getline(cin, line)) {
+void stopServer(int) {
+  unlink(serverSocket);
+  _exit(0);
+}
 
-      vector<Token> tokenLine = scan(line);
-      prog.push_back(tokenLine);
-      bool hasInstr = 0;
-      int tokenCount = 0;
-      int operandCur = 0;
-      int operandMax = 0;
-      vector<vector<Token::Kind>> operandTypes;
-      vector<Token::Kind> op;
+// Prints how to run the assembler, returning the exit status for misuse
+int usage(const char *name) {
+  cerr << "Usage: " << name << " [-o file] [-j threads] [--merl] [--relax $r]"
+    << " [--cache dir [--cache-size megabytes] [--cache-stats]]"
+    << " [--stats[=json]] < program.asm" << endl
+    << "       " << name << " [-j threads] [--merl] [--relax $r]"
+    << " [--cache dir [--cache-size megabytes]] --batch [program.asm...]"
+    << endl
+    << "       " << name << " [-j threads] [--allow-incbin] --serve socket"
+    << endl;
+  return 1;
+}
 
-      // Pass 1
-      for (auto &token : tokenLine) {
+int main(int argc, char *argv[]) {
+  unique_ptr<InputBuffer> input;   // the program's source text
+  AssemblyCache::Entry result;     // the words and symbol table to output
 
-        tokenCount++;
-        Token::Kind kind = token.getKind();
-        Token::Kind prevKind = prevToken.getKind();
-        string lexeme = token.getLexeme();
-        string prevLexeme = prevToken.getLexeme();
+  const char *outputPath = nullptr; // where to write the machine code
+  AssemblerOptions options;         // how to assemble the program
+  const char *cacheDir = nullptr;   // where to cache results, if anywhere
+  uint64_t cacheSize = 256;         // the most the cache may hold, in MiB
+  bool cacheStats = false;          // whether to just report on the cache
+  bool batch = false;               // whether to assemble files in a batch
+  vector<string> batchPaths;        // and which, if given on the command line
+  int stats = 0;                    // 1 to report stats, 2 to as JSON
+  bool allowIncbin = false;         // whether served programs may .incbin
 
-        // First token has to be LABEL, WORD or ID 
-        // (jr,jalr,add,sub,slt,sltu,beq or bne)
-        if (tokenCount == 1 && kind == Token::LABEL) {
-          label = lexeme;
-          label.pop_back();
-          // Check for duplicate label
-          if (labels.find(label) == labels.end()) {
-            labels[label] = pcValue;
-          }
-          else {
-            throw ScanningFailure("ERROR: Duplicate symbol " + label);
-          }
-        }
-        else if (tokenCount == 1 && kind == Token::WORD) {
-          hasInstr = 1;
-          operandTypes = setTypes(lexeme); 
-          operandMax = operandTypes.size();
-        }
-        else if (tokenCount == 1 && kind == Token::ID) {
-          hasInstr = 1;
-          if (lexeme == "jr" || lexeme == "jalr" ||
-              lexeme == "add" || lexeme == "sub" ||
-              lexeme == "slt" || lexeme == "sltu" ||
-              lexeme == "beq" || lexeme == "bne" ||
-              lexeme == "lis" || lexeme == "mfhi" ||
-              lexeme == "mflo" ||
-              lexeme == "mult" || lexeme == "multu" ||
-              lexeme == "div" || lexeme == "divu" ||
-              lexeme == "sw" || lexeme == "lw") {
-            operandTypes = setTypes(lexeme);
-            operandMax = operandTypes.size();
-          }
-          else {
-            throw ScanningFailure("ERROR: Invalid directive ." + lexeme);
-          }
-        }
-        else if (tokenCount == 1) {
-          throw ScanningFailure("ERROR: Invalid directive ." + lexeme);
-        }
-        // If prevToken is a LABEL, token has to be a LABEL, WORD or ID
-        // (jr,jalr,add,sub,slt,sltu,beq,bne,lis,mfhi or mflo)
-        else if (prevKind == Token::LABEL) {
-          if (kind == Token::LABEL) {
-            label = lexeme;
-            label.pop_back();
-            // Check for duplicate label
-            if (labels.find(label) == labels.end()) {
-              labels[label] = pcValue;
-            }
-            else {
-              throw ScanningFailure("ERROR: Duplicate symbol " + label);
-            }
-          }
-          else if (kind == Token::WORD) {
-            hasInstr = 1;
-            operandMax = 1;
-          }
-          else if (kind == Token::ID) {
-            hasInstr = 1;
-            if (lexeme == "jr" || lexeme == "jalr" ||
-                lexeme == "add" || lexeme == "sub" ||
-                lexeme == "slt" || lexeme == "sltu" ||
-                lexeme == "beq" || lexeme == "bne" ||
-                lexeme == "lis" || lexeme == "mfhi" ||
-                lexeme == "mflo" ||
-                lexeme == "mult" || lexeme == "multu" ||
-                lexeme == "div" || lexeme == "divu" ||
-                lexeme == "sw" || lexeme == "lw") {
-              operandTypes = setTypes(lexeme);
-              operandMax = operandTypes.size();
-            }
-            else {
-              throw ScanningFailure("ERROR: Invalid directive ." + lexeme);
-            }
-          }
-          else {
-            throw ScanningFailure(
-              "ERROR: Expecting opcode, label, or directive, but got " + lexeme);
-          }
-        }
-        // If prevToken is a WORD, token should be a INT/HEXINT or LABEL
-        else if (prevKind == Token::WORD) {
-          operandCur = 1;
-          if (kind == Token::INT || kind == Token::HEXINT) {
-            checkBounds(&token);
-          }
-          else if (kind == Token::ID) {
-            operandLabel = lexeme;
-            operandLabels.push_back(operandLabel);
-          }
-          else {
-            throw ScanningFailure("ERROR: Invalid operand after " + prevLexeme);
-          }
-        }
-        // If prevToken is a valid instruction keyword, token should be REG
-        else if (prevKind == Token::ID && (
-          prevLexeme == "jr" || prevLexeme == "jalr" ||
-          prevLexeme == "add" || prevLexeme == "sub" ||
-          prevLexeme == "slt" || prevLexeme == "sltu" ||
-          prevLexeme == "beq" || prevLexeme == "bne" ||
-          prevLexeme == "lis" || prevLexeme == "mfhi" ||
-          prevLexeme == "mflo" ||
-          prevLexeme == "mult" || prevLexeme == "multu" ||
-          prevLexeme == "div" || prevLexeme == "divu" ||
-          prevLexeme == "sw" || prevLexeme == "lw")) {
-          operandCur = 1;
-          op = operandTypes[operandCur-1];
-          if (find(op.begin(), op.end(), kind) == op.end()) {
-            throw ScanningFailure("ERROR: Invalid operand after " + prevLexeme);
-          }
-          else if (kind == Token::REG) { 
-            checkBounds(&token);
-          }
-          else {
-            cerr << "Something wrong with setTypes." << endl;
-          }
-        }
-        // If prevToken is an INT/HEX, token is a COMMA; otherwise invalid
-        else if (prevKind == Token::INT || prevKind == Token::HEXINT) {
-          operandCur += 1;
-          op = operandTypes[operandCur-1];
-          if (operandCur > operandMax) {
-            throw ScanningFailure(
-              "ERROR: Expected end of line, but there is more stuff");
-          }
-          else if (find(op.begin(), op.end(), kind) == op.end()) {
-            throw ScanningFailure("ERROR: Invalid operand after " + prevLexeme);
-          }
-        }
-        // If prevToken is a REG, token is COMMA or RPAREN; otherwise invalid
-        else if (prevKind == Token::REG) {
-          operandCur += 1;
-          op = operandTypes[operandCur-1];
-          if (operandCur > operandMax) {
-            throw ScanningFailure(
-              "ERROR: Expected end of line, but there is more stuff");
-          }
-          else if (find(op.begin(), op.end(), kind) == op.end()) {
-            throw ScanningFailure("ERROR: Invalid operand after " + prevLexeme);
-          }
-        }
-        // If prevToken is a COMMA, token is either REG, INT/HEX or ID 
-        else if (prevKind == Token::COMMA) {
-          operandCur += 1;
-          op = operandTypes[operandCur-1];
-          if (operandCur > operandMax) {
-            throw ScanningFailure(
-              "Should not happen, something wrong with operandMax.");
-          }
-          else if (find(op.begin(), op.end(), kind) == op.end()) {
-            throw ScanningFailure("ERROR: Invalid operand after " + prevLexeme);
-          }
-          else if (kind == Token::REG) {
-            checkBounds(&token);
-          }
-          else if (kind == Token::INT || kind == Token::HEXINT) {
-            checkBounds(&token, 1);
-          }
-          else if (kind == Token::ID) {
-            operandLabel = lexeme;
-            operandLabels.push_back(operandLabel);
-            iLabel pair{operandLabel, pcValue};
-            labelPC.push_back(pair);
-          }
-        }
-        // If prevToken is a LPAREN, token should be REG; otherwise invalid
-        else if (prevKind == Token::LPAREN) {
-          operandCur += 1;
-          op = operandTypes[operandCur-1];
-          if (operandCur > operandMax) {
-            throw ScanningFailure(
-              "Should not happen, something wrong with operandMax.");
-          }
-          else if (find(op.begin(), op.end(), kind) == op.end()) {
-            throw ScanningFailure("ERROR: Invalid operand after " + prevLexeme);
-          }
-          else if (kind == Token::REG) {
-            checkBounds(&token);
-          }
-        }
-        // If prevToken is a RPAREN, token is invalid
-        else if (prevKind == Token::LPAREN) {
-            throw ScanningFailure(
-              "ERROR: Expected end of line, but there is more stuff");
-        }
-        // Any other tokens is invalid
-        else {
-          throw ScanningFailure("ERROR: Invalid directive ." + prevLexeme);
-        }
-        // Keep track of the previous token
-        prevToken = token;
-      }
+  // One thread per hardware thread unless -j says otherwise
+  options.threads = 0;
 
-      // Check if this line ends properly. If there is an instruction,
-      // increment memory address
-      if (hasInstr) {
-        if (operandMax != operandCur) {
-          throw ScanningFailure("ERROR: Missing operand after " 
-            + prevToken.getLexeme());
-        }
-        pcValue += 4;
-      }
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "-o" && i + 1 < argc) {
+      outputPath = argv[++i];
     }
-    // Check if each label in operand exists in symbol table
-    for (auto &label : operandLabels) {
-      if (labels.find(label) == labels.end()) {
-        throw ScanningFailure("ERROR: No such label: " + label);
-      }
+    else if (arg == "-j" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+      options.threads = atoi(argv[++i]);
     }
-    // Check if each label in operand of bne/beq satisfies 
-    // -32768 < (i-l-4)/4 < 32767.
-    for (auto &pair : labelPC) {
-      string lex = pair.label;
-      int l = pair.pc;
-      int i = labels[lex];
-      int v = (i - l - 4) / 4;
-      if (v > SHRT_MAX || v < SHRT_MIN) {
-        throw ScanningFailure("ERROR: Constant out of bound.");
+    else if (arg == "--merl") {
+      options.relocatable = true;
+    }
+    else if (arg == "--relax" && i + 1 < argc) {
+      const char *reg = argv[++i];
+      reg += *reg == '$';
+      options.relaxRegister = atoi(reg);
+      if (options.relaxRegister < 1 || options.relaxRegister > 31) {
+        cerr << "ERROR: Invalid register for --relax " << argv[i] << endl;
+        return usage(argv[0]);
       }
     }
+    else if (arg == "--cache" && i + 1 < argc) {
+      cacheDir = argv[++i];
+    }
+    else if (arg == "--cache-size" && i + 1 < argc
+        && atoi(argv[i + 1]) > 0) {
+      cacheSize = atoi(argv[++i]);
+    }
+    else if (arg == "--cache-stats") {
+      cacheStats = true;
+    }
+    else if (arg == "--serve" && i + 1 < argc) {
+      serverSocket = argv[++i];
+    }
+    else if (arg == "--allow-incbin") {
+      allowIncbin = true;
+    }
+    else if (arg == "--stats" || arg == "--stats=json") {
+      stats = arg == "--stats" ? 1 : 2;
+    }
+    else if (arg == "--batch") {
+      batch = true;
+    }
+    else if (batch && arg[0] != '-') {
+      batchPaths.push_back(arg);
+    }
+    else {
+      cerr << "ERROR: Unrecognized argument " << arg << endl;
+      return usage(argv[0]);
+    }
   }
-  catch (ScanningFailure &f) {
-    cerr << f.what() << endl;
-    return 1;
+  if (cacheStats && cacheDir == nullptr) {
+    cerr << "ERROR: --cache-stats needs --cache" << endl;
+    return usage(argv[0]);
+  }
+  if (serverSocket != nullptr && (batch || outputPath != nullptr
+      || cacheDir != nullptr || stats != 0 || options.relocatable
+      || options.relaxRegister >= 0)) {
+    // Clients choose how their programs are assembled
+    cerr << "ERROR: --serve can only be used with -j and --allow-incbin"
+      << endl;
+    return usage(argv[0]);
+  }
+  if (allowIncbin && serverSocket == nullptr) {
+    cerr << "ERROR: --allow-incbin needs --serve" << endl;
+    return usage(argv[0]);
+  }
+  if (batch && (outputPath != nullptr || cacheStats || stats != 0)) {
+    cerr << "ERROR: --batch cannot be used with -o, --cache-stats or --stats"
+      << endl;
+    return usage(argv[0]);
   }
 
-  // Pass 2. 
-  // Assuming program is valid, translate into machine code
-  int pc = -4; // pc address (initial = no instruction = -4)
-  for (auto &tokenLine : prog) {
-    int64_t op1 = 0;
-    int64_t op2 = 0;
-    int64_t op3 = 0;
-    int operandCur = 0; // Number of operands read in
-    int operandMax = 0; // Number of operands allowed
-    int numOpCount = 0; // Number of operands that are numbers
-    vector<vector<Token::Kind>> operandTypes;
-    string instrType = "";
-
-    for (auto &token : tokenLine) {
-      Token::Kind kind = token.getKind();
-      string lexeme = token.getLexeme();
+  if (serverSocket != nullptr) {
+    try {
+      AssemblerServer server(serverSocket, options.threads, allowIncbin);
+      signal(SIGINT, stopServer);
+      signal(SIGTERM, stopServer);
+      server.run();
+    }
+    catch (ScanningFailure &f) {
+      cerr << f.what() << endl;
+    }
+    return 1;
+  }
 
-      if (instrType != "" && operandMax == 0) {
-        operandTypes = setTypes(instrType);
-        operandMax = operandTypes.size();
+  Assembler assembler(options);
+  unique_ptr<AssemblyCache> cache;
+  string salt = assemblerBuild() + (options.relocatable ? " --merl" : "")
+    + " --relax " + to_string(options.relaxRegister);
+  bool assembled;
+  bool cached;
+  try {
+    if (cacheDir != nullptr) {
+      cache.reset(new AssemblyCache(cacheDir, cacheSize << 20));
+      if (cacheStats) {
+        outputCacheStats(cacheDir, *cache);
+        return 0;
       }
+    }
 
-      if (kind == Token::WORD) {
-        instrType = lexeme;
-        pc += 4;
-      }
-      else if (kind == Token::ID) {
-        if (instrType == "beq" || instrType == "bne") {
-          numOpCount += 1;
-          operandCur += 1;
-          int val = labels[lexeme];
-          if (numOpCount == 1) op1 = (val - pc - 4) / 4; // shouldn't happen
-          else if (numOpCount == 2) op2 = (val - pc - 4) / 4; // shouldn't happen
-          else if (numOpCount == 3) op3 = (val - pc - 4) / 4;
-        }
-        else if (instrType == ".word") {
-          numOpCount += 1;
-          operandCur += 1;
-          op1 = labels[lexeme];
-        }
-        else if (lexeme == "jr" || lexeme == "jalr" ||
-            lexeme == "add" || lexeme == "sub" ||
-            lexeme == "slt" || lexeme == "sltu" ||
-            lexeme == "beq" || lexeme == "bne"  ||
-            lexeme == "lis" || lexeme == "mfhi" ||
-            lexeme == "mflo" ||
-            lexeme == "mult" || lexeme == "multu" ||
-            lexeme == "div" || lexeme == "divu" ||
-            lexeme == "sw" || lexeme == "lw") {
-          if (instrType == "") {
-            instrType = lexeme;
-            pc += 4;
+    if (batch) {
+      if (batchPaths.empty()) {
+        string path;
+        while (getline(cin, path)) {
+          if (!path.empty()) {
+            batchPaths.push_back(path);
           }
         }
       }
-      else if (kind == Token::COMMA || 
-        kind == Token::LPAREN ||
-        kind == Token::RPAREN) {
-        operandCur += 1;
-      }
-      else if (kind == Token::INT || 
-               kind == Token::HEXINT ||
-               kind == Token::REG) {
-        operandCur += 1;
-        numOpCount += 1;
-        int64_t op = token.toLong();
-        if (numOpCount == 1) op1 = op;
-        else if (numOpCount == 2) op2 = op;
-        else if (numOpCount == 3) op3 = op;
-      }
-      // If read end of the line, assemble and output it
-      if (operandCur == operandMax && operandMax != 0) {
-        int64_t instr = assembleInstr(instrType, op1, op2, op3);
-        outputQueue.push_back(instr);
-      }
+      return assembleBatch(assembler, cache.get(), salt, batchPaths,
+        options.relocatable);
+    }
+
+    input.reset(new InputBuffer(0));
+    assembled = assembleCached(assembler, cache.get(), salt, input->data(),
+      input->size(), result, cached);
+  }
+  catch (ScanningFailure &f) {
+    cerr << f.what() << endl;
+    return 1;
+  }
+  if (!assembled) {
+    for (auto &diagnostic : assembler.diagnostics()) {
+      cerr << diagnostic.message << endl;
+    }
+    if (stats != 0) {
+      outputStats(assembler.stats(), false, stats == 2);
     }
+    return 1;
   }
+
   // Output equivalent MIPS machine language program
   // and the symbol table
-  for (const auto &instr : outputQueue) {
-    outputBytes(instr);
+  try {
+    if (outputPath != nullptr) {
+      writeWordsToFile(outputPath, result.words.data(), result.words.size());
+    }
+    else {
+      WordWriter writer(STDOUT_FILENO);
+      writer.write(result.words.data(), result.words.size());
+      writer.flush();
+    }
+  }
+  catch (ScanningFailure &f) {
+    cerr << f.what() << endl;
+    return 1;
+  }
+  cerr << result.listing;
+  if (stats != 0) {
+    outputStats(assembler.stats(), cached, stats == 2);
   }
-  outputSymbolTable(labels);
 
   return 0;
 }
@@ -0,0 +1,164 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "scanner.h"
+#include "input.h"
+#include "output.h"
+#include "protocol.h"
+using namespace std;
+
+/*
+ * Client for asm --serve, which saves starting a new assembler process
+ * for every program.
+ *
+ * Usage: asmc [--socket path] [-o file] [--merl] [--relax $r] < program.asm
+ *
+ * Sends the program to the server listening on path (or on $ASM_SOCKET),
+ * and outputs the result exactly as asm with the same options would,
+ * except that .incbin is an error unless the server allows it.
+ *
+ * With --bench n [-j clients], sends the program n times instead, split
+ * between clients connections used at once, and reports how many requests
+ * the server answered per second.
+ */
+
+// Sends source to the server at path requests times over each of clients
+// connections at once, and prints the throughput.
+int benchmark(const string &path, const AssemblerOptions &options,
+    const InputBuffer &source, size_t requests, size_t clients) {
+  atomic<size_t> failures(0);
+  vector<thread> threads;
+  auto start = chrono::steady_clock::now();
+  for (size_t c = 0; c < clients; ++c) {
+    size_t count = requests / clients + (c < requests % clients);
+    threads.emplace_back([&, count]() {
+      try {
+        int fd = connectToServer(path);
+        ServerResponse response;
+        for (size_t i = 0; i < count; ++i) {
+          sendRequest(fd, options, source.data(), source.size());
+          receiveResponse(fd, response);
+          failures += !response.ok;
+        }
+        close(fd);
+      }
+      catch (ScanningFailure &f) {
+        cerr << f.what() << endl;
+        failures += count;
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  chrono::duration<double> seconds = chrono::steady_clock::now() - start;
+
+  cout << requests << " requests from " << clients << " clients in "
+    << fixed << setprecision(3) << seconds.count() << " s: "
+    << setprecision(0) << requests / seconds.count() << " requests/s, "
+    << setprecision(1) << 1e6 * seconds.count() * clients / requests
+    << " us each" << endl;
+  if (failures > 0) {
+    cerr << "ERROR: " << failures << " requests failed" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+int usage(const char *name) {
+  cerr << "Usage: " << name << " [--socket path] [-o file] [--merl]"
+    << " [--relax $r] < program.asm" << endl
+    << "       " << name << " [--socket path] [--merl] [--relax $r]"
+    << " --bench requests [-j clients] < program.asm" << endl;
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  const char *socketPath = getenv("ASM_SOCKET");
+  const char *outputPath = nullptr;
+  AssemblerOptions options;
+  size_t requests = 0;              // how many to send, if benchmarking
+  size_t clients = 1;
+
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "--socket" && i + 1 < argc) {
+      socketPath = argv[++i];
+    }
+    else if (arg == "-o" && i + 1 < argc) {
+      outputPath = argv[++i];
+    }
+    else if (arg == "--merl") {
+      options.relocatable = true;
+    }
+    else if (arg == "--relax" && i + 1 < argc) {
+      const char *reg = argv[++i];
+      reg += *reg == '$';
+      options.relaxRegister = atoi(reg);
+      if (options.relaxRegister < 1 || options.relaxRegister > 31) {
+        cerr << "ERROR: Invalid register for --relax " << argv[i] << endl;
+        return usage(argv[0]);
+      }
+    }
+    else if (arg == "--bench" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+      requests = atoi(argv[++i]);
+    }
+    else if (arg == "-j" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+      clients = atoi(argv[++i]);
+    }
+    else {
+      cerr << "ERROR: Unrecognized argument " << arg << endl;
+      return usage(argv[0]);
+    }
+  }
+  if (socketPath == nullptr) {
+    cerr << "ERROR: No server socket: use --socket or set ASM_SOCKET" << endl;
+    return usage(argv[0]);
+  }
+
+  try {
+    InputBuffer input(0);
+    if (requests > 0) {
+      return benchmark(socketPath, options, input, requests,
+        min(clients, requests));
+    }
+
+    ServerResponse response;
+    int fd = connectToServer(socketPath);
+    try {
+      sendRequest(fd, options, input.data(), input.size());
+      receiveResponse(fd, response);
+    } catch (ScanningFailure &f) {
+      close(fd);
+      throw;
+    }
+    close(fd);
+    if (!response.ok) {
+      cerr << response.text;
+      return 1;
+    }
+
+    if (outputPath != nullptr) {
+      writeWordsToFile(outputPath, response.words.data(),
+        response.words.size());
+    }
+    else {
+      WordWriter writer(STDOUT_FILENO);
+      writer.write(response.words.data(), response.words.size());
+      writer.flush();
+    }
+    cerr << response.text;
+  }
+  catch (ScanningFailure &f) {
+    cerr << f.what() << endl;
+    return 1;
+  }
+  return 0;
+}
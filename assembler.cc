@@ -0,0 +1,945 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include "assembler.h"
+#include "scanner.h"
+#include "input.h"
+#include "opcodes.h"
+#include "output.h"
+#include "threadpool.h"
+
+// A label operand of an instruction or .word. The word at index in the
+// output is patched once every label is known: a WORD fixup stores the
+// label's address, and a BRANCH fixup fills in the offset of a beq or bne.
+struct Fixup {
+  enum Kind { WORD, BRANCH };
+  Kind kind;
+  uint32_t label;
+  size_t index;
+  uint32_t line;
+};
+
+// A label, .import or .export in a chunk, at an address relative to the
+// chunk
+struct ChunkSymbol {
+  uint32_t symbol;
+  int address;
+  uint32_t line;
+};
+
+// A run of whole lines of the program, assembled on its own. Symbol ids,
+// addresses, output indices and line numbers are all local to the chunk
+// until the chunks are merged. Chunks are kept from one program to the
+// next, so that their memory is reused.
+struct Chunk {
+  const char *text;                    // the chunk's source text
+  size_t size;
+  Symbols symbols;                     // ids of the chunk's identifiers
+  std::vector<uint32_t> words;         // machine code, labels left as 0
+  std::vector<ChunkSymbol> labels;     // labels, in order of definition
+  std::vector<Fixup> fixups;           // label operands, in order
+  std::vector<ChunkSymbol> imports;    // .import symbols, in order
+  std::vector<ChunkSymbol> exports;    // .export symbols, in order
+  std::vector<size_t> branches;        // beq and bne with numeric offsets,
+                                       // only recorded when relaxing
+  // The size of words after each .space, .fill and .incbin, and its line
+  std::vector<std::pair<size_t, uint32_t>> data;
+  uint32_t lines;                      // the number of lines scanned
+  bool failed;                         // whether the chunk has an error
+  Diagnostic failure;                  // and if so, its first one
+
+  // Working space for assembleChunk
+  std::vector<TokenView> tokens;       // tokens of the current block
+  std::vector<int> defined;            // address of each label, by id
+
+  // What assembling the chunk took
+  PhaseStats phases[AssemblerStats::numPhases];
+  uint64_t tokenCount;
+
+  // Filled in by Assembler::merge
+  size_t base;                         // index of words[0] in the program
+  uint32_t firstLine;                  // number of the chunk's first line
+  std::vector<uint32_t> globalIds;     // program-wide id of each local id
+  std::vector<uint32_t> relocations;   // the chunk's MERL REL entries
+  std::vector<MerlSymbol> references;  // and its ESR entries
+
+  // Starts over with the size bytes at text, keeping any memory
+  void reset(const char *text, size_t size) {
+    this->text = text;
+    this->size = size;
+    symbols.clear();
+    words.clear();
+    labels.clear();
+    fixups.clear();
+    imports.clear();
+    exports.clear();
+    branches.clear();
+    data.clear();
+    lines = 0;
+    failed = false;
+    for (auto &phase : phases) {
+      phase = PhaseStats();
+    }
+    tokenCount = 0;
+    relocations.clear();
+    references.clear();
+  }
+
+  // The number in the whole program of line (a line of this chunk)
+  uint32_t programLine(uint32_t line) const {
+    return firstLine + line - 1;
+  }
+};
+
+namespace {
+
+// Programs smaller than this are not worth splitting up, and each chunk
+// of a larger one is at least this big
+const size_t minChunkSize = 256 * 1024;
+const size_t minParallelSize = 4 * minChunkSize;
+
+// Lines are scanned in blocks of this many at a time
+const size_t linesPerBlock = 4096;
+
+// Returns the offset field of a beq or bne at pc branching to address,
+// or throws if it is out of range
+int64_t branchOffset(int address, int pc) {
+  int v = (address - pc - 4) / 4;
+  if (v > SHRT_MAX || v < SHRT_MIN) {
+    throw ScanningFailure("ERROR: Constant out of bound.");
+  }
+  return v;
+}
+
+// Appends the contents of the file at path, which must be a whole number
+// of big-endian words, to words
+void appendFile(const std::string &path, std::vector<uint32_t> &words) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw ScanningFailure("ERROR: Cannot read " + path);
+  }
+  std::unique_ptr<InputBuffer> input;
+  try {
+    input.reset(new InputBuffer(fd));
+  } catch (ScanningFailure &f) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+
+  if (input->size() % 4 != 0) {
+    throw ScanningFailure("ERROR: Size of " + path
+      + " is not a multiple of 4");
+  }
+  const unsigned char *bytes =
+    reinterpret_cast<const unsigned char *>(input->data());
+  size_t start = words.size();
+  words.resize(start + input->size() / 4);
+  for (size_t i = start; i < words.size(); ++i, bytes += 4) {
+    words[i] = loadBigEndian(bytes);
+  }
+}
+
+// Throws an error if the immediate operand token does not fit an
+// immediate of the given width
+void checkBounds(const TokenView &token, Opcode::Immediate immediate) {
+  int64_t instr = token.value;
+
+  if (immediate == Opcode::HALF) { // i in lw, sw, beq, bne
+    if (token.kind == Token::INT) {
+      if (instr > SHRT_MAX || instr < SHRT_MIN) {
+        throw ScanningFailure("ERROR: Constant out of bound.");
+      }
+    } else if (token.kind == Token::HEXINT) {
+      if (instr > USHRT_MAX) {
+        throw ScanningFailure("ERROR: Constant out of bound.");
+      }
+    }
+  }
+  // Operands of data directives, and registers, are already checked by
+  // the scanner
+}
+
+// Returns true if a token of the given kind may appear where the
+// character c of an operand signature (see Opcode) expects one
+bool matchesOperand(char c, Token::Kind kind) {
+  switch (c) {
+    case 'r': return kind == Token::REG;
+    case 'i': return kind == Token::INT || kind == Token::HEXINT;
+    case 'l': return kind == Token::INT || kind == Token::HEXINT
+                || kind == Token::ID;
+    case ',': return kind == Token::COMMA;
+    case '(': return kind == Token::LPAREN;
+    case ')': return kind == Token::RPAREN;
+  }
+  return false;
+}
+
+// Assembles chunk, stopping at its first error. A scanning error is only
+// reported once every line before it has been checked, as if lines were
+// scanned one at a time. Unless relocatable, .import and .export are
+// scanning errors like any other unknown directive.
+void assembleChunk(Chunk &chunk, const AssemblerOptions &options) {
+  std::vector<TokenView> &tokens = chunk.tokens;
+  std::vector<int> &defined = chunk.defined;
+  int pcValue = 0;
+  uint32_t line = 0;               // the line being assembled
+  PhaseTimer pass1(chunk.phases[AssemblerStats::PASS1]);
+
+  defined.clear();
+
+  // Returns the text of a token, for error messages
+  auto lexeme = [&chunk](const TokenView &token) {
+    return std::string(chunk.text + token.offset, token.length);
+  };
+
+  ProgramScanner scanner(chunk.text, chunk.size, &chunk.symbols);
+  try {
+    std::unique_ptr<ScanningFailure> scanFailure;
+    uint32_t scanFailureLine = 0;
+    bool moreLines = true;
+
+    while (moreLines) {
+      tokens.clear();
+      pass1.stop();
+      try {
+        PhaseTimer scan(chunk.phases[AssemblerStats::SCAN]);
+        moreLines = scanner.scanLines(tokens, linesPerBlock);
+      } catch (ScanningFailure &f) {
+        scanFailure.reset(new ScanningFailure(f));
+        scanFailureLine = scanner.nextLine();
+        moreLines = false;
+      }
+      pass1.start();
+      chunk.tokenCount += tokens.size();
+      // Reject .import and .export here, so that they fail like any other
+      // unknown directive would have while scanning
+      if (!options.relocatable) {
+        for (size_t i = 0, lineStart = 0; i < tokens.size(); ++i) {
+          if (tokens[i].kind == Token::NEWLINE) {
+            lineStart = i + 1;
+          }
+          else if (tokens[i].kind == Token::IMPORT
+              || tokens[i].kind == Token::EXPORT) {
+            scanFailure.reset(new ScanningFailure(
+              "ERROR: DOTID token unrecognized: " + lexeme(tokens[i])));
+            scanFailureLine = tokens[i].line;
+            tokens.resize(lineStart);
+            moreLines = false;
+            break;
+          }
+        }
+      }
+      defined.resize(chunk.symbols.size(), -1);
+
+      // Each iteration handles one line, leaving next on its NEWLINE
+      for (size_t next = 0; next < tokens.size(); ++next) {
+        size_t lineStart = next;
+        line = tokens[next].line;
+
+        // A line starts with any number of labels
+        for (; tokens[next].kind == Token::LABEL; ++next) {
+          const TokenView &token = tokens[next];
+          // Check for duplicate label
+          if (defined[token.symbol] >= 0) {
+            throw ScanningFailure("ERROR: Duplicate symbol "
+              + chunk.symbols.name(token.symbol));
+          }
+          defined[token.symbol] = pcValue;
+          chunk.labels.push_back(ChunkSymbol{token.symbol, pcValue, line});
+        }
+        if (tokens[next].kind == Token::NEWLINE) {
+          continue;
+        }
+
+        // Then an instruction or directive
+        const TokenView &instr = tokens[next];
+
+        // .import and .export name one symbol and produce no code
+        if (instr.kind == Token::IMPORT || instr.kind == Token::EXPORT) {
+          const TokenView &name = tokens[++next];
+          if (name.kind == Token::NEWLINE) {
+            throw ScanningFailure("ERROR: Missing operand after "
+              + lexeme(instr));
+          }
+          if (name.kind != Token::ID) {
+            throw ScanningFailure("ERROR: Invalid operand after "
+              + lexeme(instr));
+          }
+          if (tokens[++next].kind != Token::NEWLINE) {
+            throw ScanningFailure(
+              "ERROR: Expected end of line, but there is more stuff");
+          }
+          ChunkSymbol symbol{name.symbol, pcValue, line};
+          if (instr.kind == Token::IMPORT) {
+            chunk.imports.push_back(symbol);
+          }
+          else {
+            chunk.exports.push_back(symbol);
+          }
+          continue;
+        }
+
+        // .word takes any number of operands, each a word of its own
+        if (instr.kind == Token::WORD) {
+          for (;;) {
+            const TokenView &prevToken = tokens[next++];
+            const TokenView &token = tokens[next];
+
+            if (token.kind == Token::NEWLINE) {
+              throw ScanningFailure("ERROR: Missing operand after "
+                + lexeme(prevToken));
+            }
+            if (!matchesOperand('l', token.kind)) {
+              throw ScanningFailure("ERROR: Invalid operand after "
+                + lexeme(prevToken));
+            }
+            if (token.kind == Token::ID) {
+              chunk.fixups.push_back(Fixup{Fixup::WORD, token.symbol,
+                chunk.words.size(), line});
+            }
+            chunk.words.push_back(token.kind == Token::ID ? 0
+              : static_cast<uint32_t>(token.value));
+            pcValue += 4;
+
+            if (tokens[++next].kind == Token::NEWLINE) {
+              break;
+            }
+            if (tokens[next].kind != Token::COMMA) {
+              throw ScanningFailure(
+                "ERROR: Expected end of line, but there is more stuff");
+            }
+          }
+          continue;
+        }
+
+        // The other data directives add a run of words in one go
+        if (instr.kind == Token::SPACE || instr.kind == Token::FILL
+            || instr.kind == Token::INCBIN) {
+          const char *signature = instr.kind == Token::SPACE ? "i"
+            : instr.kind == Token::FILL ? "i,i" : "s";
+          int64_t ops[2] = {0, 0};
+          int numOps = 0;
+          std::string path;
+          for (; *signature != '\0'; ++signature) {
+            const TokenView &prevToken = tokens[next++];
+            const TokenView &token = tokens[next];
+
+            if (token.kind == Token::NEWLINE) {
+              throw ScanningFailure("ERROR: Missing operand after "
+                + lexeme(prevToken));
+            }
+            if (*signature == 's' ? token.kind != Token::STRING
+                : !matchesOperand(*signature, token.kind)) {
+              throw ScanningFailure("ERROR: Invalid operand after "
+                + lexeme(prevToken));
+            }
+            if (*signature == 'i') {
+              ops[numOps++] = token.value;
+            }
+            else if (*signature == 's') {
+              path.assign(chunk.text + token.offset + 1, token.length - 2);
+            }
+          }
+          if (tokens[++next].kind != Token::NEWLINE) {
+            throw ScanningFailure(
+              "ERROR: Expected end of line, but there is more stuff");
+          }
+
+          size_t start = chunk.words.size();
+          if (instr.kind == Token::INCBIN) {
+            if (!options.incbin) {
+              throw ScanningFailure("ERROR: .incbin is not allowed");
+            }
+            appendFile(path, chunk.words);
+          }
+          else {
+            int64_t count = ops[0];
+            if (instr.kind == Token::SPACE) {
+              if (count % 4 != 0) {
+                throw ScanningFailure("ERROR: Size of .space is not a "
+                  "multiple of 4");
+              }
+              count /= 4;
+            }
+            if (count < 0 || pcValue + 4 * count > INT_MAX) {
+              throw ScanningFailure("ERROR: Constant out of bound.");
+            }
+            chunk.words.resize(start + count, static_cast<uint32_t>(ops[1]));
+          }
+          if (pcValue + 4 * static_cast<int64_t>(chunk.words.size() - start)
+              > INT_MAX) {
+            throw ScanningFailure("ERROR: Constant out of bound.");
+          }
+          pcValue += 4 * (chunk.words.size() - start);
+          // pcValue is only the chunk's, so merge checks these again
+          chunk.data.emplace_back(chunk.words.size(), line);
+          continue;
+        }
+
+        const Opcode *opcode = nullptr;
+        if (instr.kind == Token::ID) {
+          opcode = findOpcode(chunk.text + instr.offset, instr.length);
+        }
+        if (opcode == nullptr) {
+          if (next == lineStart || instr.kind == Token::ID) {
+            throw ScanningFailure("ERROR: Invalid directive ." + lexeme(instr));
+          }
+          throw ScanningFailure(
+            "ERROR: Expecting opcode, label, or directive, but got "
+            + lexeme(instr));
+        }
+
+        // And its operands, which must match its signature exactly
+        int64_t ops[3] = {0, 0, 0};    // operands, in order
+        int numOps = 0;                // number of operands in ops
+        for (const char *expected = opcode->operands; *expected != '\0';
+            ++expected) {
+          const TokenView &prevToken = tokens[next++];
+          const TokenView &token = tokens[next];
+
+          if (token.kind == Token::NEWLINE) {
+            throw ScanningFailure("ERROR: Missing operand after "
+              + lexeme(prevToken));
+          }
+          if (!matchesOperand(*expected, token.kind)) {
+            throw ScanningFailure("ERROR: Invalid operand after "
+              + lexeme(prevToken));
+          }
+          if (token.kind == Token::ID) {
+            // Labels are filled in once the whole program is known
+            Fixup::Kind kind =
+              opcode->pcRelative ? Fixup::BRANCH : Fixup::WORD;
+            chunk.fixups.push_back(Fixup{kind, token.symbol,
+              chunk.words.size(), line});
+            ++numOps;
+          }
+          else if (token.kind == Token::INT || token.kind == Token::HEXINT) {
+            checkBounds(token, opcode->immediate);
+            ops[numOps++] = token.value;
+            if (opcode->pcRelative && options.relaxRegister >= 0) {
+              chunk.branches.push_back(chunk.words.size());
+            }
+          }
+          else if (token.kind == Token::REG) {
+            ops[numOps++] = token.value;
+          }
+        }
+        if (tokens[++next].kind != Token::NEWLINE) {
+          throw ScanningFailure(
+            "ERROR: Expected end of line, but there is more stuff");
+        }
+
+        chunk.words.push_back(opcode->encode(ops));
+        pcValue += 4;
+      }
+    }
+    if (scanFailure) {
+      line = scanFailureLine;
+      throw *scanFailure;
+    }
+  }
+  catch (ScanningFailure &f) {
+    chunk.failed = true;
+    chunk.failure = Diagnostic{f.what(), line};
+  }
+  // Tasks on the pool must not throw, so a .space, .fill or .incbin too
+  // big to hold is reported at its line like any other error
+  catch (std::bad_alloc &) {
+    chunk.failed = true;
+    chunk.failure = Diagnostic{"ERROR: Out of memory", line};
+  }
+  catch (std::exception &e) {
+    chunk.failed = true;
+    chunk.failure = Diagnostic{std::string("ERROR: ") + e.what(), line};
+  }
+  chunk.lines = scanner.nextLine() - 1;
+}
+
+// Splits the size bytes at text into at most n pieces of whole lines, of
+// roughly equal size, returning the start of each piece and the end
+std::vector<const char *> splitLines(const char *text, size_t size,
+    size_t n) {
+  std::vector<const char *> splits = {text};
+  const char *end = text + size;
+  for (size_t i = 1; i < n && splits.back() != end; ++i) {
+    const char *target = std::max(text + size / n * i, splits.back());
+    const char *newline = static_cast<const char *>(
+        memchr(target, '\n', end - target));
+    splits.push_back(newline == nullptr ? end : newline + 1);
+  }
+  if (splits.back() != end) {
+    splits.push_back(end);
+  }
+  return splits;
+}
+
+// A beq or bne in the program, at word index, branching to word target
+struct BranchSite {
+  size_t index;
+  int64_t target;
+};
+
+} // namespace
+
+Assembler::Assembler(const AssemblerOptions &options): relaxed(0) {
+  setOptions(options);
+}
+
+Assembler::~Assembler() {}
+
+void Assembler::setOptions(const AssemblerOptions &options) {
+  this->options = options;
+  if (this->options.threads == 0) {
+    this->options.threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (pool && pool->size() != this->options.threads) {
+    pool.reset();
+  }
+}
+
+bool Assembler::assemble(const char *source, size_t size) {
+  symbols.clear();
+  addresses.clear();
+  program.code.clear();
+  program.relocations.clear();
+  program.references.clear();
+  program.definitions.clear();
+  output.clear();
+  table.clear();
+  problems.clear();
+  relaxed = 0;
+  statistics = AssemblerStats();
+
+  timespec wallStart, cpuStart;
+  clock_gettime(CLOCK_MONOTONIC, &wallStart);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuStart);
+
+  // Split large programs into a few chunks per thread, so that a thread
+  // that finishes early can pick up another one
+  size_t numChunks = 1;
+  if (options.threads > 1 && size >= minParallelSize) {
+    numChunks = std::min(options.threads * 4, size / minChunkSize);
+  }
+  std::vector<const char *> splits = splitLines(source, size, numChunks);
+  numChunks = splits.size() - 1;
+  while (chunks.size() < numChunks) {
+    chunks.emplace_back(new Chunk());
+  }
+  for (size_t i = 0; i < numChunks; ++i) {
+    chunks[i]->reset(splits[i], splits[i + 1] - splits[i]);
+  }
+
+  try {
+    if (numChunks > 1) {
+      if (!pool) {
+        pool.reset(new ThreadPool(options.threads));
+      }
+      pool->parallelFor(numChunks,
+        [this](size_t i) { assembleChunk(*chunks[i], options); });
+    }
+    else if (numChunks == 1) {
+      assembleChunk(*chunks[0], options);
+    }
+    merge(numChunks);
+  }
+  catch (Diagnostic &d) {
+    problems.push_back(d);
+  }
+  if (problems.empty()) {
+    PhaseTimer pass2(statistics.phases[AssemblerStats::PASS2]);
+    finish();
+  }
+
+  // Add up what the chunks took, and the total
+  statistics.chunks = numChunks;
+  for (size_t c = 0; c < numChunks; ++c) {
+    Chunk &chunk = *chunks[c];
+    for (int phase = 0; phase < AssemblerStats::numPhases; ++phase) {
+      statistics.phases[phase] += chunk.phases[phase];
+    }
+    statistics.tokens += chunk.tokenCount;
+    statistics.lines += chunk.lines;
+    statistics.labels += chunk.labels.size();
+    statistics.fixups += chunk.fixups.size();
+  }
+  statistics.bytes = output.size() * 4;
+  for (auto &phase : statistics.phases) {
+    statistics.total.allocations += phase.allocations;
+    statistics.total.allocatedBytes += phase.allocatedBytes;
+  }
+  timespec wallEnd, cpuEnd;
+  clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuEnd);
+  statistics.total.wallMicros = (wallEnd.tv_sec - wallStart.tv_sec) * 1000000
+    + (wallEnd.tv_nsec - wallStart.tv_nsec) / 1000;
+  statistics.total.cpuMicros = (cpuEnd.tv_sec - cpuStart.tv_sec) * 1000000
+    + (cpuEnd.tv_nsec - cpuStart.tv_nsec) / 1000;
+  return problems.empty();
+}
+
+void Assembler::finish() {
+  if (options.relocatable) {
+    output = program.toWords();
+  }
+  else {
+    output.swap(program.code);
+  }
+
+  for (uint32_t id = 0; id < addresses.size(); ++id) {
+    if (addresses[id] >= 0) {
+      table.push_back(AssembledLabel{symbols.name(id),
+        static_cast<uint32_t>(addresses[id])});
+    }
+  }
+  std::sort(table.begin(), table.end(),
+    [](const AssembledLabel &a, const AssembledLabel &b) {
+      return a.name < b.name;
+    });
+}
+
+/* Rewrites every beq and bne of the merged program whose target is out of
+ * range as a branch with the opposite condition over lis, .word target and
+ * jr, using options.relaxRegister. The code grows by three words for each,
+ * which can push other branches out of range, so this repeats until none
+ * are. Numeric branch offsets, labels and MERL tables are adjusted to the
+ * new layout. Returns the number of branches relaxed.
+ */
+size_t Assembler::relax(size_t numChunks, const std::vector<char> &imported) {
+  const int origin = options.relocatable ? MerlObject::codeStart : 0;
+  const uint32_t scratch = options.relaxRegister;
+  const std::vector<uint32_t> &code = program.code;
+  const int64_t size = code.size();
+
+  // Branches to a word outside the program are left alone
+  std::vector<BranchSite> sites;
+  for (size_t c = 0; c < numChunks; ++c) {
+    Chunk &chunk = *chunks[c];
+    for (size_t index : chunk.branches) {
+      int64_t i = chunk.base + index;
+      int64_t target = i + 1 + static_cast<int16_t>(code[i] & 0xffff);
+      if (target >= 0 && target <= size) {
+        sites.push_back(BranchSite{static_cast<size_t>(i), target});
+      }
+    }
+    for (auto &fixup : chunk.fixups) {
+      if (fixup.kind == Fixup::BRANCH) {
+        int address = addresses[chunk.globalIds[fixup.label]];
+        sites.push_back(BranchSite{chunk.base + fixup.index,
+          (address - origin) / 4});
+      }
+    }
+  }
+  std::sort(sites.begin(), sites.end(),
+    [](const BranchSite &a, const BranchSite &b) { return a.index < b.index; });
+
+  // moved(i) is where word i of the program ends up, given the sites
+  // relaxed so far; before[k] counts the relaxed sites before site k
+  std::vector<char> isRelaxed(sites.size(), false);
+  std::vector<size_t> before(sites.size() + 1, 0);
+  auto moved = [&](int64_t i) {
+    size_t k = std::lower_bound(sites.begin(), sites.end(), i,
+      [](const BranchSite &site, int64_t i) {
+        return static_cast<int64_t>(site.index) < i;
+      }) - sites.begin();
+    return i + 3 * static_cast<int64_t>(before[k]);
+  };
+  auto offset = [&](const BranchSite &site) {
+    return moved(site.target) - moved(site.index) - 1;
+  };
+
+  size_t count = 0;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t k = 0; k < sites.size(); ++k) {
+      before[k + 1] = before[k] + isRelaxed[k];
+    }
+    for (size_t k = 0; k < sites.size(); ++k) {
+      int64_t v = offset(sites[k]);
+      if (!isRelaxed[k] && (v > SHRT_MAX || v < SHRT_MIN)) {
+        isRelaxed[k] = true;
+        changed = true;
+        ++count;
+      }
+    }
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  // Lay the code out again, relaxing branches and fixing up offsets
+  std::vector<uint32_t> relaid;
+  std::vector<uint32_t> relocations;
+  relaid.reserve(size + 3 * count);
+  for (int64_t i = 0, k = 0; i < size; ++i) {
+    uint32_t word = code[i];
+    if (k == static_cast<int64_t>(sites.size())
+        || static_cast<int64_t>(sites[k].index) != i) {
+      relaid.push_back(word);
+      continue;
+    }
+
+    const BranchSite &site = sites[k];
+    if (isRelaxed[k++]) {
+      // beq and bne differ only in the lowest bit of the opcode
+      relaid.push_back(((word ^ 1u << 26) & 0xffff0000) | 3);
+      relaid.push_back(scratch << 11 | 20);
+      if (options.relocatable) {
+        relocations.push_back(origin + relaid.size() * 4);
+      }
+      relaid.push_back(origin + moved(site.target) * 4);
+      relaid.push_back(scratch << 21 | 8);
+    }
+    else {
+      relaid.push_back((word & 0xffff0000) | (offset(site) & 0xffff));
+    }
+  }
+
+  auto movedAddress = [&](uint32_t address) {
+    return static_cast<uint32_t>(origin + moved((address - origin) / 4) * 4);
+  };
+  for (auto &address : addresses) {
+    if (address >= 0) {
+      address = movedAddress(address);
+    }
+  }
+  for (size_t c = 0; c < numChunks; ++c) {
+    Chunk &chunk = *chunks[c];
+    for (auto &fixup : chunk.fixups) {
+      uint32_t id = chunk.globalIds[fixup.label];
+      if (fixup.kind == Fixup::WORD && !imported[id]) {
+        relaid[moved(chunk.base + fixup.index)] = addresses[id];
+      }
+    }
+  }
+  for (auto &address : program.relocations) {
+    address = movedAddress(address);
+  }
+  program.relocations.insert(program.relocations.end(), relocations.begin(),
+    relocations.end());
+  std::sort(program.relocations.begin(), program.relocations.end());
+  for (auto &symbol : program.references) {
+    symbol.address = movedAddress(symbol.address);
+  }
+  for (auto &symbol : program.definitions) {
+    symbol.address = movedAddress(symbol.address);
+  }
+
+  program.code.swap(relaid);
+  return count;
+}
+
+/* Combines the first numChunks chunks, in order, into the program's
+ * machine code and (if relocatable) MERL tables, and its labels in symbols
+ * and addresses (indexed by symbol id, with -1 for symbols that are not
+ * labels). Throws the Diagnostic that assembling the program as one chunk
+ * would have reported first.
+ */
+void Assembler::merge(size_t numChunks) {
+  const bool relocatable = options.relocatable;
+  const bool relaxing = options.relaxRegister >= 0;
+  const int origin = relocatable ? MerlObject::codeStart : 0;
+  PhaseTimer resolve(statistics.phases[AssemblerStats::RESOLVE]);
+
+  // Lay the chunks out one after another, stopping at the first error.
+  // A chunk stops at its own first error, so a duplicate of an earlier
+  // chunk's label comes before any error the chunk reports.
+  size_t size = 0;
+  uint32_t lines = 0;
+  for (size_t c = 0; c < numChunks; ++c) {
+    Chunk &chunk = *chunks[c];
+    chunk.base = size;
+    size += chunk.words.size();
+    chunk.firstLine = lines + 1;
+    lines += chunk.lines;
+
+    // A chunk only checks its data against its own size, so find the
+    // first .space, .fill or .incbin that takes the whole program past
+    // INT_MAX bytes, which assembling it as one chunk would have stopped
+    // at, before anything that big is allocated
+    uint32_t tooBig = 0;
+    if (size * 4 > INT_MAX) {
+      for (auto &data : chunk.data) {
+        if ((chunk.base + data.first) * 4 > INT_MAX) {
+          tooBig = data.second;
+          break;
+        }
+      }
+    }
+
+    chunk.globalIds.resize(chunk.symbols.size());
+    for (uint32_t id = 0; id < chunk.symbols.size(); ++id) {
+      chunk.globalIds[id] = symbols.intern(chunk.symbols.name(id));
+    }
+    addresses.resize(symbols.size(), -1);
+
+    for (auto &label : chunk.labels) {
+      if (tooBig != 0 && label.line > tooBig) {
+        break;
+      }
+      uint32_t id = chunk.globalIds[label.symbol];
+      if (addresses[id] >= 0) {
+        throw Diagnostic{"ERROR: Duplicate symbol " + symbols.name(id),
+          chunk.programLine(label.line)};
+      }
+      addresses[id] = origin + chunk.base * 4 + label.address;
+    }
+    if (tooBig != 0) {
+      throw Diagnostic{"ERROR: Constant out of bound.",
+        chunk.programLine(tooBig)};
+    }
+    if (chunk.failed) {
+      throw Diagnostic{chunk.failure.message,
+        chunk.programLine(chunk.failure.line)};
+    }
+  }
+
+  // An imported symbol must not also be a label of this program
+  std::vector<char> imported(symbols.size(), false);
+  for (size_t c = 0; c < numChunks; ++c) {
+    Chunk &chunk = *chunks[c];
+    for (auto &symbol : chunk.imports) {
+      uint32_t id = chunk.globalIds[symbol.symbol];
+      if (addresses[id] >= 0) {
+        throw Diagnostic{"ERROR: Duplicate symbol " + symbols.name(id),
+          chunk.programLine(symbol.line)};
+      }
+      imported[id] = true;
+    }
+  }
+
+  // Check if each label in operand exists in symbol table
+  for (size_t c = 0; c < numChunks; ++c) {
+    Chunk &chunk = *chunks[c];
+    for (auto &fixup : chunk.fixups) {
+      uint32_t id = chunk.globalIds[fixup.label];
+      if (imported[id] && fixup.kind == Fixup::BRANCH) {
+        throw Diagnostic{"ERROR: Cannot branch to imported symbol "
+          + symbols.name(id), chunk.programLine(fixup.line)};
+      }
+      if (addresses[id] < 0 && !imported[id]) {
+        throw Diagnostic{"ERROR: No such label: " + symbols.name(id),
+          chunk.programLine(fixup.line)};
+      }
+    }
+  }
+
+  // And each exported one
+  std::vector<char> exported(symbols.size(), false);
+  for (size_t c = 0; c < numChunks; ++c) {
+    Chunk &chunk = *chunks[c];
+    for (auto &symbol : chunk.exports) {
+      uint32_t id = chunk.globalIds[symbol.symbol];
+      if (addresses[id] < 0) {
+        throw Diagnostic{"ERROR: No such label: " + symbols.name(id),
+          chunk.programLine(symbol.line)};
+      }
+      if (!exported[id]) {
+        exported[id] = true;
+        program.definitions.push_back(
+          MerlSymbol{symbols.name(id), static_cast<uint32_t>(addresses[id])});
+      }
+    }
+  }
+
+  // Copy each chunk into place and patch its label operands. Labels of
+  // bne/beq must satisfy -32768 < (i-l-4)/4 < 32767, unless the branch
+  // is to be relaxed. outOfRange holds the line of each chunk's first
+  // branch that does not, or 0.
+  resolve.stop();
+  PhaseTimer pass2(statistics.phases[AssemblerStats::PASS2]);
+  program.code.resize(size);
+  std::vector<uint32_t> outOfRange(numChunks, 0);
+  pass2.stop();
+  auto place = [&](size_t c) {
+    Chunk &chunk = *chunks[c];
+    PhaseTimer timer(chunk.phases[AssemblerStats::PASS2]);
+    uint32_t *words = program.code.data() + chunk.base;
+    std::copy(chunk.words.begin(), chunk.words.end(), words);
+    for (auto &fixup : chunk.fixups) {
+      uint32_t id = chunk.globalIds[fixup.label];
+      uint32_t pc = origin + (chunk.base + fixup.index) * 4;
+      if (fixup.kind == Fixup::BRANCH) {
+        try {
+          words[fixup.index] |= branchOffset(addresses[id], pc) & 0xffff;
+        } catch (ScanningFailure &f) {
+          if (!relaxing && outOfRange[c] == 0) {
+            outOfRange[c] = chunk.programLine(fixup.line);
+          }
+        }
+      }
+      else if (imported[id]) {
+        chunk.references.push_back(MerlSymbol{symbols.name(id), pc});
+      }
+      else {
+        words[fixup.index] = addresses[id];
+        if (relocatable) {
+          chunk.relocations.push_back(pc);
+        }
+      }
+    }
+    chunk.words.clear();
+  };
+  if (numChunks > 1) {
+    pool->parallelFor(numChunks, place);
+  }
+  else {
+    for (size_t c = 0; c < numChunks; ++c) {
+      place(c);
+    }
+  }
+  pass2.start();
+  for (uint32_t line : outOfRange) {
+    if (line != 0) {
+      throw Diagnostic{"ERROR: Constant out of bound.", line};
+    }
+  }
+
+  for (size_t c = 0; c < numChunks; ++c) {
+    Chunk &chunk = *chunks[c];
+    program.relocations.insert(program.relocations.end(),
+      chunk.relocations.begin(), chunk.relocations.end());
+    program.references.insert(program.references.end(),
+      chunk.references.begin(), chunk.references.end());
+  }
+
+  if (relaxing) {
+    relaxed = relax(numChunks, imported);
+  }
+}
+
+const std::vector<uint32_t> &Assembler::words() const { return output; }
+
+const std::vector<AssembledLabel> &Assembler::labels() const {
+  return table;
+}
+
+const std::vector<Diagnostic> &Assembler::diagnostics() const {
+  return problems;
+}
+
+size_t Assembler::relaxedBranches() const { return relaxed; }
+
+const AssemblerStats &Assembler::stats() const { return statistics; }
+
+const char *const AssemblerStats::phaseNames[numPhases] = {
+  "scan", "pass1", "resolve", "pass2"
+};
+
+std::string Assembler::listing() const {
+  std::string text;
+  // The relaxation report is a comment, so that it cannot be mistaken for
+  // a label of the symbol table after it
+  if (options.relaxRegister >= 0) {
+    text = "; relaxed " + std::to_string(relaxed) + " branches\n";
+  }
+  for (auto &label : table) {
+    text += label.name + " " + std::to_string(label.address) + "\n";
+  }
+  return text;
+}
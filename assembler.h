@@ -0,0 +1,137 @@
+#ifndef CS241_ASSEMBLER_H
+#define CS241_ASSEMBLER_H
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "merl.h"
+#include "stats.h"
+#include "symbols.h"
+
+class ThreadPool;
+struct Chunk;
+
+/* Options that change what the assembler produces, or how.
+ */
+struct AssemblerOptions {
+  // Output a MERL object (see merl.h), allowing .import and .export
+  bool relocatable = false;
+
+  // If not -1, a beq or bne whose target is too far away is rewritten as
+  // a branch with the opposite condition around lis $r, .word target and
+  // jr $r, where r is this register, instead of being an error
+  int relaxRegister = -1;
+
+  // Whether .incbin may read files; if not, it is an error, as in a program
+  // from someone who should not see the files this process can read
+  bool incbin = true;
+
+  // Large programs are assembled on this many threads (0 for one per
+  // hardware thread); the result is the same however many there are
+  size_t threads = 1;
+};
+
+/* A problem found while assembling a program. line is the (1-based) line
+ * of the program it was found on, or 0 if it does not belong to one line.
+ */
+struct Diagnostic {
+  std::string message;
+  uint32_t line;
+};
+
+/* A label of an assembled program, with its address.
+ */
+struct AssembledLabel {
+  std::string name;
+  uint32_t address;
+};
+
+/* What it took to assemble a program, phase by phase. Scanning and the
+ * first pass, which checks and encodes each line, alternate a block of
+ * lines at a time; resolving lays out the whole program and checks its
+ * labels, and the second pass fills in label operands (and relaxes
+ * branches). total is the elapsed time, and the CPU time of the whole
+ * process, of assembling.
+ */
+struct AssemblerStats {
+  enum Phase { SCAN, PASS1, RESOLVE, PASS2, numPhases };
+  static const char *const phaseNames[numPhases];
+
+  PhaseStats phases[numPhases];
+  PhaseStats total;
+  uint64_t chunks = 0;              // pieces assembled independently
+  uint64_t tokens = 0;              // tokens scanned, newlines included
+  uint64_t lines = 0;
+  uint64_t labels = 0;              // labels defined
+  uint64_t fixups = 0;              // label operands
+  uint64_t bytes = 0;               // bytes of output
+};
+
+/* Assembles programs held in memory, reporting the results and any errors
+ * through its accessors rather than on any stream. An Assembler can
+ * assemble any number of programs one after another, reusing its memory
+ * (and its threads) from one to the next.
+ *
+ * The program is split into chunks of whole lines, which are scanned,
+ * checked and encoded independently (on several threads for large
+ * programs) and then merged, resolving labels. Assembly stops at the same
+ * first error it would have stopped at had the lines been assembled one
+ * at a time in order.
+ */
+class Assembler {
+    AssemblerOptions options;
+    std::vector<std::unique_ptr<Chunk>> chunks;
+    std::unique_ptr<ThreadPool> pool;
+
+    Symbols symbols;                  // ids of all labels and identifiers
+    std::vector<int> addresses;       // address of each label, by id
+    MerlObject program;
+    std::vector<uint32_t> output;
+    std::vector<AssembledLabel> table;
+    std::vector<Diagnostic> problems;
+    size_t relaxed;
+    AssemblerStats statistics;
+
+    void merge(size_t numChunks);
+    void finish();                    // builds the results from program
+    size_t relax(size_t numChunks, const std::vector<char> &imported);
+
+  public:
+    explicit Assembler(const AssemblerOptions &options = AssemblerOptions());
+    ~Assembler();
+
+    Assembler(const Assembler &) = delete;
+    Assembler &operator=(const Assembler &) = delete;
+
+    // Changes how the programs assembled from now on are assembled.
+    void setOptions(const AssemblerOptions &options);
+
+    /* Assembles the size bytes of source, replacing the results of the
+     * previous program. Returns false, with the error in diagnostics, if
+     * the program has errors. Files named by .incbin are read relative to
+     * the working directory.
+     */
+    bool assemble(const char *source, size_t size);
+
+    // The program: its machine code, or a MERL file if relocatable.
+    const std::vector<uint32_t> &words() const;
+
+    // The program's labels, sorted by name.
+    const std::vector<AssembledLabel> &labels() const;
+
+    // Why the program failed to assemble, if it did.
+    const std::vector<Diagnostic> &diagnostics() const;
+
+    // The number of branches relaxed.
+    size_t relaxedBranches() const;
+
+    // What assembling the program took, as far as it got.
+    const AssemblerStats &stats() const;
+
+    // The text reported alongside the program: a comment counting the
+    // relaxed branches if relaxing, then a "name address" line per label.
+    std::string listing() const;
+};
+
+#endif
@@ -0,0 +1,292 @@
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include "cache.h"
+#include "input.h"
+#include "output.h"
+#include "scanner.h"
+#include "sha256.h"
+
+namespace {
+
+// Entries start with this, then the number of words and the length of the
+// listing (both big-endian), then the words (big-endian) and the text
+const char entryMagic[8] = {'c', 's', '2', '4', '1', 'a', 's', 'm'};
+const size_t headerSize = sizeof(entryMagic) + 8;
+
+// The stats file holds these counters, in this order. BYTES is the total
+// size of the entries as last worked out plus what has been stored since,
+// plus one, or 0 if it has not been worked out.
+enum Counter { HITS, MISSES, EVICTIONS, BYTES, numCounters };
+const char *const statsName = "stats";
+
+// Temporary files this old were left behind by a process that died
+const time_t staleAge = 60 * 60;
+
+// Numbers the temporary files of this process
+std::atomic<unsigned> temporaries(0);
+
+uint64_t loadCounter(const unsigned char *p) {
+  return static_cast<uint64_t>(loadBigEndian(p)) << 32 | loadBigEndian(p + 4);
+}
+
+void storeCounter(unsigned char *p, uint64_t value) {
+  storeBigEndian(p, value >> 32);
+  storeBigEndian(p + 4, value);
+}
+
+bool isEntryName(const char *name) {
+  size_t length = strlen(name);
+  return length == 64 && strspn(name, "0123456789abcdef") == length;
+}
+
+bool writeAll(int fd, const void *data, size_t size) {
+  const char *p = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Holds an exclusive flock on fd for as long as it lives
+class FileLock {
+    int fd;
+
+  public:
+    explicit FileLock(int fd): fd(fd) {
+      while (flock(fd, LOCK_EX) < 0 && errno == EINTR) {}
+    }
+    ~FileLock() { flock(fd, LOCK_UN); }
+};
+
+} // namespace
+
+AssemblyCache::AssemblyCache(const std::string &dir, uint64_t limit):
+  dir(dir), limit(limit) {
+  struct stat info;
+  if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST) {
+    throw ScanningFailure("ERROR: Cannot use cache " + dir + ": "
+      + strerror(errno));
+  }
+  if (stat(dir.c_str(), &info) < 0 || !S_ISDIR(info.st_mode)
+      || access(dir.c_str(), R_OK | W_OK | X_OK) < 0) {
+    throw ScanningFailure("ERROR: Cannot use cache " + dir
+      + ": not a writable directory");
+  }
+}
+
+std::string AssemblyCache::path(const std::string &name) const {
+  return dir + "/" + name;
+}
+
+std::string AssemblyCache::key(const std::string &salt, const char *input,
+    size_t size) {
+  Sha256 hash;
+  // The salt is length-prefixed so that no salt and input pair can be
+  // mistaken for another
+  uint64_t saltLength = salt.size();
+  hash.update(&saltLength, sizeof(saltLength));
+  hash.update(salt);
+  hash.update(input, size);
+  return hash.hexDigest();
+}
+
+bool AssemblyCache::lookup(const std::string &key, Entry &entry) {
+  int fd = open(path(key).c_str(), O_RDONLY);
+  if (fd < 0) {
+    count(MISSES);
+    return false;
+  }
+
+  bool valid = false;
+  try {
+    InputBuffer input(fd);
+    const unsigned char *bytes =
+      reinterpret_cast<const unsigned char *>(input.data());
+    if (input.size() >= headerSize
+        && memcmp(bytes, entryMagic, sizeof(entryMagic)) == 0) {
+      uint64_t numWords = loadBigEndian(bytes + sizeof(entryMagic));
+      uint64_t textSize = loadBigEndian(bytes + sizeof(entryMagic) + 4);
+      if (input.size() == headerSize + 4 * numWords + textSize) {
+        const unsigned char *p = bytes + headerSize;
+        entry.words.resize(numWords);
+        for (auto &word : entry.words) {
+          word = loadBigEndian(p);
+          p += 4;
+        }
+        entry.listing.assign(reinterpret_cast<const char *>(p), textSize);
+        valid = true;
+      }
+    }
+  } catch (ScanningFailure &f) {
+    valid = false;
+  }
+
+  // Mark the entry as recently used
+  if (valid) {
+    futimens(fd, nullptr);
+  }
+  close(fd);
+  count(valid ? HITS : MISSES);
+  return valid;
+}
+
+void AssemblyCache::store(const std::string &key,
+    const std::vector<uint32_t> &words, const std::string &listing) {
+  std::vector<unsigned char> bytes(headerSize + 4 * words.size());
+  memcpy(bytes.data(), entryMagic, sizeof(entryMagic));
+  storeBigEndian(bytes.data() + sizeof(entryMagic), words.size());
+  storeBigEndian(bytes.data() + sizeof(entryMagic) + 4, listing.size());
+  unsigned char *p = bytes.data() + headerSize;
+  for (uint32_t word : words) {
+    storeBigEndian(p, word);
+    p += 4;
+  }
+
+  // Temporary names start with a dot, so they are never taken for entries
+  std::string temporary = path(".tmp-" + std::to_string(getpid()) + "-"
+    + std::to_string(temporaries++));
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    return;
+  }
+  bool written = writeAll(fd, bytes.data(), bytes.size())
+    && writeAll(fd, listing.data(), listing.size());
+  if (close(fd) < 0 || !written
+      || rename(temporary.c_str(), path(key).c_str()) < 0) {
+    unlink(temporary.c_str());
+    return;
+  }
+
+  evict(bytes.size() + listing.size());
+}
+
+void AssemblyCache::count(int counter, uint64_t amount) {
+  int fd = open(path(statsName).c_str(), O_RDWR | O_CREAT, 0666);
+  if (fd < 0) {
+    return;
+  }
+  {
+    FileLock lock(fd);
+    unsigned char bytes[8 * numCounters] = {};
+    if (pread(fd, bytes, sizeof(bytes), 0) >= 0) {
+      unsigned char *p = bytes + 8 * counter;
+      storeCounter(p, loadCounter(p) + amount);
+      pwrite(fd, bytes, sizeof(bytes), 0);
+    }
+  }
+  close(fd);
+}
+
+void AssemblyCache::evict(uint64_t added) {
+  int fd = open(path(statsName).c_str(), O_RDWR | O_CREAT, 0666);
+  if (fd < 0) {
+    return;
+  }
+  {
+    FileLock lock(fd);
+    unsigned char bytes[8 * numCounters] = {};
+    if (pread(fd, bytes, sizeof(bytes), 0) >= 0) {
+      // Only read the directory when the entries may have outgrown the
+      // limit, or nobody has yet
+      const uint64_t recorded = loadCounter(bytes + 8 * BYTES);
+      uint64_t total = recorded == 0 ? 0 : recorded - 1 + added;
+      uint64_t evicted = 0;
+      if ((recorded != 0 && total <= limit) || scan(total, evicted)) {
+        storeCounter(bytes + 8 * BYTES, total + 1);
+        storeCounter(bytes + 8 * EVICTIONS,
+          loadCounter(bytes + 8 * EVICTIONS) + evicted);
+        pwrite(fd, bytes, sizeof(bytes), 0);
+      }
+    }
+  }
+  close(fd);
+}
+
+bool AssemblyCache::scan(uint64_t &total, uint64_t &evicted) {
+  struct Found {
+    std::string name;
+    time_t used;
+    uint64_t size;
+  };
+
+  std::unique_ptr<DIR, int (*)(DIR *)> d(opendir(dir.c_str()), closedir);
+  if (d == nullptr) {
+    return false;
+  }
+  std::vector<Found> entries;
+  total = 0;
+  time_t now = time(nullptr);
+  while (struct dirent *e = readdir(d.get())) {
+    struct stat info;
+    if (stat(path(e->d_name).c_str(), &info) < 0) {
+      continue;
+    }
+    if (isEntryName(e->d_name)) {
+      entries.push_back(Found{e->d_name, info.st_mtime,
+        static_cast<uint64_t>(info.st_size)});
+      total += info.st_size;
+    }
+    else if (strncmp(e->d_name, ".tmp-", 5) == 0
+        && now - info.st_mtime > staleAge) {
+      unlink(path(e->d_name).c_str());
+    }
+  }
+
+  // Delete the least recently used entries until the rest fit
+  std::sort(entries.begin(), entries.end(),
+    [](const Found &a, const Found &b) { return a.used < b.used; });
+  for (auto &entry : entries) {
+    if (total <= limit) {
+      break;
+    }
+    if (unlink(path(entry.name).c_str()) == 0) {
+      total -= entry.size;
+      ++evicted;
+    }
+  }
+  return true;
+}
+
+AssemblyCache::Stats AssemblyCache::stats() {
+  Stats stats = {0, 0, 0, 0, 0, limit};
+
+  int fd = open(path(statsName).c_str(), O_RDONLY);
+  if (fd >= 0) {
+    unsigned char bytes[8 * numCounters] = {};
+    {
+      FileLock lock(fd);
+      pread(fd, bytes, sizeof(bytes), 0);
+    }
+    close(fd);
+    stats.hits = loadCounter(bytes + 8 * HITS);
+    stats.misses = loadCounter(bytes + 8 * MISSES);
+    stats.evictions = loadCounter(bytes + 8 * EVICTIONS);
+  }
+
+  std::unique_ptr<DIR, int (*)(DIR *)> d(opendir(dir.c_str()), closedir);
+  while (struct dirent *e = d ? readdir(d.get()) : nullptr) {
+    struct stat info;
+    if (isEntryName(e->d_name) && stat(path(e->d_name).c_str(), &info) == 0) {
+      ++stats.entries;
+      stats.bytes += info.st_size;
+    }
+  }
+  return stats;
+}
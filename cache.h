@@ -0,0 +1,72 @@
+#ifndef CS241_CACHE_H
+#define CS241_CACHE_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* A directory of previously assembled programs, keyed by a SHA-256 hash of
+ * their source (and of everything else that affects the result), so that
+ * assembling the same program again only has to read back the result.
+ *
+ * Several processes may share a directory. Entries are written to a
+ * temporary file and renamed into place, so readers only ever see whole
+ * entries. Using an entry updates its modification time; when the entries
+ * outgrow the size limit, the least recently used ones are deleted. The
+ * hit, miss and eviction counters in the stats file, a running total of
+ * the entries' size (so that the directory is only read when it may be
+ * over the limit), and eviction itself, are serialized by an flock on that
+ * file.
+ *
+ * The cache is only an optimization: failing to read or write an entry is
+ * treated as a miss rather than an error.
+ */
+class AssemblyCache {
+    std::string dir;
+    uint64_t limit;
+
+    std::string path(const std::string &name) const;
+    void count(int counter, uint64_t amount = 1);
+    // Deletes old entries if the entries, with added bytes more, may be
+    // over the limit
+    void evict(uint64_t added);
+    // Deletes the least recently used entries (and stale temporary files)
+    // until the rest fit, adding how many to evicted and setting total to
+    // the size of the rest. Returns false if the directory cannot be read.
+    bool scan(uint64_t &total, uint64_t &evicted);
+
+  public:
+    // What an entry holds: the machine code, and the text reported with
+    // it (the symbol table and any notes)
+    struct Entry {
+      std::vector<uint32_t> words;
+      std::string listing;
+    };
+
+    struct Stats {
+      uint64_t hits, misses, evictions;
+      uint64_t entries, bytes, limit;
+    };
+
+    /* Uses the cache in dir, creating the directory if needed, and keeps
+     * its entries to at most limit bytes in total. Throws ScanningFailure
+     * if dir cannot be used.
+     */
+    AssemblyCache(const std::string &dir, uint64_t limit);
+
+    // Returns the key of the size bytes of source at input, assembled by
+    // an assembler identified by salt (its version and options).
+    static std::string key(const std::string &salt, const char *input,
+        size_t size);
+
+    // Fills in entry and returns true if the cache has one for key.
+    bool lookup(const std::string &key, Entry &entry);
+
+    // Adds an entry for key, evicting old entries if necessary.
+    void store(const std::string &key, const std::vector<uint32_t> &words,
+        const std::string &listing);
+
+    Stats stats();
+};
+
+#endif
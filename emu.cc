@@ -0,0 +1,389 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "scanner.h"
+#include "input.h"
+#include "mips.h"
+#include "jit.h"
+#include "profile.h"
+#include "runtime.h"
+#include "trace.h"
+using namespace std;
+
+/*
+ * MIPS emulator for the assembler's output, in place of mips.twoints and
+ * mips.array.
+ *
+ * Usage: emu [--array | --array-file file] [--jit | --no-fuse]
+ *   [--native-runtime] [--profile file] [--callgraph file]
+ *   [--symbols file] [--trace file] program.mips [value...]
+ *
+ * Loads the program at address 0 and runs it with $30 at the top of memory
+ * and $31 holding the return address that stops it. By default $1 and $2
+ * are set to two integers; with --array they hold the address and length
+ * of an array of integers, stored just after the program. The values are
+ * taken from the command line if given, and otherwise read from standard
+ * input after a prompt, as the original tools do.
+ *
+ * --array-file file gives the array as a file of 32-bit integers in the
+ * host's byte order (little-endian on x86-64), e.g. as written by numpy's
+ * int32 tofile. It is mapped into memory at the first page boundary after
+ * the program instead of being read, so even an array of hundreds of
+ * megabytes costs only the page faults of the elements the program
+ * touches, and memory is made larger than the usual 16 MiB to hold it.
+ *
+ * With --jit, the program is translated to x86-64 as it runs (see jit.h)
+ * instead of interpreted, with exactly the same results. Otherwise the
+ * interpreter runs the pushes and pops of compiled WLP4 code as single
+ * instructions (see Machine::fuse), unless --no-fuse is given, to compare.
+ *
+ * The program's labels are read from the symbol table that asm or link
+ * printed for it: the --symbols file, or else program.sym if there is one
+ * (as asm --batch writes).
+ *
+ * --native-runtime runs calls of the WLP4 runtime's init, new, delete and
+ * print on the host instead of their MIPS code (see NativeRuntime), each
+ * counting as one instruction, which makes programs that allocate or print
+ * a lot several times faster. The symbol table must have all four labels,
+ * as it does for a program linked with the runtime (see link --symbols).
+ * The heap is the lower half of the memory between the end of the program
+ * (or the array) and the top. Without it, the runtime's own code runs, as
+ * on the real machine.
+ *
+ * When the program returns, the registers are printed to standard error,
+ * along with how many instructions ran and how fast.
+ *
+ * --profile file counts how many times each instruction runs and branches,
+ * which makes the emulator slower by about a quarter (and uses the
+ * interpreter even with --jit). When the program stops, even with an
+ * error, a report of where the time went is printed to standard error and
+ * the full profile written to file (see Profile). The counts are
+ * attributed to the program's labels.
+ *
+ * --callgraph file follows the program's calls instead, or as well (see
+ * CallGraph), reporting how many instructions each procedure ran, itself
+ * and with what it called, and writing folded stacks to file for a flame
+ * graph tool (e.g. flamegraph.pl file > graph.svg).
+ *
+ * --trace file records every instruction run, and every word loaded or
+ * stored, to file (see trace.h), for tracedump to read back. The trace is
+ * delta encoded and compressed on another thread as the program runs,
+ * which is about 2.5 times slower than without, and typically takes a few
+ * bytes per thousand instructions. A procedure of the native runtime is
+ * recorded as one instruction at its address, without what it accesses,
+ * so what print writes is not in the trace.
+ */
+
+// The most memory a machine can have, below the input and output addresses
+const uint64_t memoryLimit = 0xffff0000;
+
+// Prompts for and reads an integer from standard input
+uint32_t readValue(const string &prompt) {
+  long long value;
+  cerr << prompt;
+  if (scanf("%lld", &value) != 1) {
+    throw ScanningFailure("ERROR: Expected an integer");
+  }
+  return static_cast<uint32_t>(value);
+}
+
+uint32_t parseValue(const char *text) {
+  char *end;
+  long long value = strtoll(text, &end, 0);
+  if (*text == '\0' || *end != '\0') {
+    throw ScanningFailure(string("ERROR: Invalid integer ") + text);
+  }
+  return static_cast<uint32_t>(value);
+}
+
+void outputRegisters(Machine &machine) {
+  cerr << "MIPS program completed normally." << endl;
+  for (int r = 1; r < 32; ++r) {
+    cerr << "$" << setw(2) << setfill('0') << dec << r << " = 0x"
+      << setw(8) << hex << machine.reg(r) << "   ";
+    if (r % 4 == 0) {
+      cerr << "\n";
+    }
+  }
+  cerr << setfill(' ') << dec << endl;
+}
+
+// Reads the labels of the program at programPath from symbolsPath, or if
+// that is null, from the program's .sym file if it has one
+vector<ProfileLabel> readLabels(const char *symbolsPath,
+    const string &programPath) {
+  if (symbolsPath != nullptr) {
+    return readSymbolTable(symbolsPath);
+  }
+  string path = programPath;
+  if (path.size() > 5 && path.compare(path.size() - 5, 5, ".mips") == 0) {
+    path.resize(path.size() - 5);
+  }
+  path += ".sym";
+  if (access(path.c_str(), R_OK) != 0) {
+    return vector<ProfileLabel>();
+  }
+  return readSymbolTable(path);
+}
+
+// Reports the profile and call graph that were asked for to stderr, and
+// writes them to their paths
+void outputProfiles(Machine &machine, const CallGraph *graph,
+    const vector<ProfileLabel> &labels, const char *profilePath,
+    const char *graphPath) {
+  if (profilePath != nullptr) {
+    Profile profile(machine, labels);
+    cerr << "\n";
+    profile.writeReport(cerr);
+    ofstream out(profilePath);
+    profile.writeData(out);
+    if (!out) {
+      throw ScanningFailure(string("ERROR: Cannot write ") + profilePath);
+    }
+  }
+  if (graph != nullptr) {
+    cerr << "\n";
+    graph->writeReport(cerr, labels);
+    ofstream out(graphPath);
+    graph->writeFolded(out, labels);
+    if (!out) {
+      throw ScanningFailure(string("ERROR: Cannot write ") + graphPath);
+    }
+  }
+}
+
+int usage(const char *name) {
+  cerr << "Usage: " << name << " [--array | --array-file file]"
+    << " [--jit | --no-fuse] [--native-runtime] [--profile file]"
+    << " [--callgraph file] [--symbols file] [--trace file] program.mips"
+    << " [value...]" << endl;
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  bool array = false;
+  bool jit = false;
+  bool fuse = true;
+  bool native = false;
+  const char *programPath = nullptr;
+  const char *arrayPath = nullptr;
+  const char *profilePath = nullptr;
+  const char *graphPath = nullptr;
+  const char *symbolsPath = nullptr;
+  const char *tracePath = nullptr;
+  vector<const char *> values;
+
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "--array" && programPath == nullptr) {
+      array = true;
+    }
+    else if (arg == "--array-file" && programPath == nullptr
+        && i + 1 < argc) {
+      arrayPath = argv[++i];
+    }
+    else if (arg == "--jit" && programPath == nullptr) {
+      jit = true;
+    }
+    else if (arg == "--no-fuse" && programPath == nullptr) {
+      fuse = false;
+    }
+    else if (arg == "--native-runtime" && programPath == nullptr) {
+      native = true;
+    }
+    else if (arg == "--profile" && programPath == nullptr && i + 1 < argc) {
+      profilePath = argv[++i];
+    }
+    else if (arg == "--callgraph" && programPath == nullptr
+        && i + 1 < argc) {
+      graphPath = argv[++i];
+    }
+    else if (arg == "--trace" && programPath == nullptr && i + 1 < argc) {
+      tracePath = argv[++i];
+    }
+    else if (arg == "--symbols" && programPath == nullptr && i + 1 < argc) {
+      symbolsPath = argv[++i];
+    }
+    else if (programPath == nullptr) {
+      programPath = argv[i];
+    }
+    else {
+      values.push_back(argv[i]);
+    }
+  }
+  if (programPath == nullptr || (!array && !values.empty()
+      && values.size() != 2) || (arrayPath != nullptr
+      && (array || !values.empty()))) {
+    return usage(argv[0]);
+  }
+
+  try {
+    int fd = open(programPath, O_RDONLY);
+    if (fd < 0) {
+      throw ScanningFailure(string("ERROR: Cannot read ") + programPath);
+    }
+    unique_ptr<InputBuffer> program;
+    try {
+      program.reset(new InputBuffer(fd));
+    } catch (ScanningFailure &f) {
+      close(fd);
+      throw;
+    }
+    close(fd);
+    if (program->size() % 4 != 0) {
+      throw ScanningFailure(string("ERROR: Size of ") + programPath
+        + " is not a multiple of 4");
+    }
+    uint32_t end = program->size();
+
+    // The array file goes after the program, with the usual amount of
+    // memory above it for the stack and heap
+    uint64_t memorySize = Machine::defaultMemorySize;
+    uint32_t arrayStart = 0;
+    int arrayFd = -1;
+    uint64_t arrayBytes = 0;
+    if (arrayPath != nullptr) {
+      arrayFd = open(arrayPath, O_RDONLY);
+      struct stat info;
+      if (arrayFd < 0 || fstat(arrayFd, &info) != 0) {
+        if (arrayFd >= 0) {
+          close(arrayFd);
+        }
+        throw ScanningFailure(string("ERROR: Cannot read ") + arrayPath);
+      }
+      arrayBytes = info.st_size;
+      if (arrayBytes % 4 != 0) {
+        close(arrayFd);
+        throw ScanningFailure(string("ERROR: Size of ") + arrayPath
+          + " is not a multiple of 4");
+      }
+      const uint64_t page = sysconf(_SC_PAGESIZE);
+      arrayStart = (end + page - 1) / page * page;
+      memorySize += arrayStart + arrayBytes;
+      if (memorySize > memoryLimit) {
+        close(arrayFd);
+        throw ScanningFailure("ERROR: Array does not fit in memory");
+      }
+    }
+
+    Machine machine(memorySize);
+    machine.fuse(fuse);
+    machine.load(reinterpret_cast<const unsigned char *>(program->data()),
+      program->size() / 4, 0);
+
+    if (arrayPath != nullptr) {
+      try {
+        machine.map(arrayFd, arrayBytes, arrayStart);
+      } catch (ScanningFailure &f) {
+        close(arrayFd);
+        throw;
+      }
+      // The mapping holds its own reference to the file
+      close(arrayFd);
+      machine.reg(1) = arrayStart;
+      machine.reg(2) = arrayBytes / 4;
+      end = arrayStart + arrayBytes;
+    }
+    else if (array) {
+      uint32_t length = values.empty() ? readValue("Enter length of array: ")
+        : values.size();
+      if (length > (machine.size() - end) / 4) {
+        throw ScanningFailure("ERROR: Array does not fit in memory");
+      }
+      for (uint32_t i = 0; i < length; ++i) {
+        machine.word(end + 4 * i) = values.empty()
+          ? readValue("Enter array element " + to_string(i) + ": ")
+          : parseValue(values[i]);
+      }
+      machine.reg(1) = end;
+      machine.reg(2) = length;
+      end += 4 * length;
+    }
+    else {
+      for (int r = 1; r <= 2; ++r) {
+        machine.reg(r) = values.empty()
+          ? readValue("Enter value for register " + to_string(r) + ": ")
+          : parseValue(values[r - 1]);
+      }
+    }
+    machine.reg(30) = machine.size();
+    machine.reg(31) = Machine::returnAddress;
+
+    vector<ProfileLabel> labels = readLabels(symbolsPath, programPath);
+    unique_ptr<NativeRuntime> runtime;
+    if (native) {
+      runtime.reset(new NativeRuntime(end,
+        end + (machine.size() - end) / 2));
+      runtime->install(machine, labels);
+    }
+    unique_ptr<CallGraph> graph;
+    if (profilePath != nullptr || graphPath != nullptr) {
+      machine.enableProfiling();
+    }
+    if (graphPath != nullptr) {
+      graph.reset(new CallGraph(0));
+      machine.traceCalls(graph.get());
+    }
+    unique_ptr<TraceWriter> trace;
+    if (tracePath != nullptr) {
+      trace.reset(new TraceWriter(tracePath));
+      machine.trace(trace.get());
+    }
+
+    auto start = chrono::steady_clock::now();
+    try {
+      if (jit) {
+        Jit(machine).run(0);
+      }
+      else {
+        machine.run(0);
+      }
+      if (trace != nullptr) {
+        trace->finish();
+      }
+    }
+    catch (ScanningFailure &f) {
+      if (trace != nullptr) {
+        trace->finish();
+      }
+      if (profilePath == nullptr && graph == nullptr) {
+        throw;
+      }
+      // The profile of a program that failed shows where it went wrong
+      fflush(stdout);
+      cerr << f.what() << endl;
+      if (graph != nullptr) {
+        graph->finish(machine.instructions());
+      }
+      outputProfiles(machine, graph.get(), labels, profilePath, graphPath);
+      return 1;
+    }
+    chrono::duration<double> seconds = chrono::steady_clock::now() - start;
+
+    fflush(stdout);
+    outputRegisters(machine);
+    cerr << machine.instructions() << " instructions in " << fixed
+      << setprecision(3) << seconds.count() << " s ("
+      << setprecision(1) << machine.instructions() / seconds.count() / 1e6
+      << " MIPS)" << endl;
+    if (graph != nullptr) {
+      graph->finish(machine.instructions());
+    }
+    outputProfiles(machine, graph.get(), labels, profilePath, graphPath);
+  }
+  catch (ScanningFailure &f) {
+    fflush(stdout);
+    cerr << f.what() << endl;
+    return 1;
+  }
+  return 0;
+}
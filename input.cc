@@ -0,0 +1,59 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include "input.h"
+#include "scanner.h"
+
+InputBuffer::InputBuffer(int fd): bytes(nullptr), length(0), mapping(nullptr) {
+  struct stat info;
+
+  // Only map regular files read from their start; mmap offsets have to be
+  // page aligned and the rest of the file is all we are allowed to consume.
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)
+      && lseek(fd, 0, SEEK_CUR) == 0) {
+    length = info.st_size;
+    if (length == 0) {
+      return;
+    }
+    void *m = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m != MAP_FAILED) {
+      madvise(m, length, MADV_SEQUENTIAL);
+      mapping = m;
+      bytes = static_cast<const char *>(m);
+      return;
+    }
+    length = 0;
+  }
+
+  // Fall back to slurping the input in large chunks.
+  const size_t chunk = 1 << 16;
+  for (;;) {
+    owned.resize(length + chunk);
+    ssize_t n = read(fd, owned.data() + length, chunk);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw ScanningFailure(std::string("ERROR: Cannot read input: ")
+          + strerror(errno));
+    }
+    if (n == 0) {
+      break;
+    }
+    length += n;
+  }
+  owned.resize(length);
+  bytes = owned.data();
+}
+
+InputBuffer::~InputBuffer() {
+  if (mapping != nullptr) {
+    munmap(mapping, length);
+  }
+}
+
+const char *InputBuffer::data() const { return bytes; }
+size_t InputBuffer::size() const { return length; }
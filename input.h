@@ -0,0 +1,30 @@
+#ifndef CS241_INPUT_H
+#define CS241_INPUT_H
+#include <cstddef>
+#include <vector>
+
+/* Holds the entire contents of a file descriptor in one contiguous buffer,
+ * so that a whole program can be scanned with a single call to scanProgram.
+ *
+ * Regular files are memory-mapped read-only; anything else (pipes,
+ * terminals) is read to end of file once into an owned buffer. Throws
+ * ScanningFailure if the input cannot be read.
+ */
+class InputBuffer {
+    const char *bytes;
+    size_t length;
+    void *mapping;
+    std::vector<char> owned;
+
+  public:
+    explicit InputBuffer(int fd);
+    ~InputBuffer();
+
+    InputBuffer(const InputBuffer &) = delete;
+    InputBuffer &operator=(const InputBuffer &) = delete;
+
+    const char *data() const;
+    size_t size() const;
+};
+
+#endif
@@ -0,0 +1,530 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <utility>
+#include "jit.h"
+#include "scanner.h"
+
+namespace {
+
+// What state[i] says about word i of memory
+enum WordState : uint8_t {
+  FREE,         // never decoded, so stores to it need no care
+  COVERED,      // decoded, and perhaps translated
+  MODIFIED      // stored to after being decoded, so only interpreted
+};
+
+// Blocks end after this many instructions even without a branch
+const size_t maxBlockLength = 64;
+
+const size_t bufferSize = 64 << 20;
+
+std::string hex(uint32_t word) {
+  char text[11];
+  snprintf(text, sizeof(text), "0x%08x", word);
+  return text;
+}
+
+// What translated code returns to Jit::run: the address to go on from,
+// and in the upper half whether to step the instruction there first
+const uint64_t stepFlag = 1ull << 32;
+
+// Host registers, by number
+enum HostRegister { EAX = 0, ECX = 1, EDX = 2 };
+
+/* Writes the x86-64 code of one block into a vector. Only a handful of
+ * instruction forms are needed, written out byte by byte; machine fields
+ * are addressed as [rbx + disp32], with rbx holding the Machine. The code
+ * can go anywhere once place has been told where.
+ */
+class Emitter {
+    std::vector<unsigned char> bytes;
+    const unsigned char *exit;        // the shared exit code
+    std::vector<size_t> exits;        // where the jumps to it are
+
+  public:
+    explicit Emitter(const unsigned char *exit): exit(exit) {}
+
+    const std::vector<unsigned char> &code() const { return bytes; }
+    size_t size() const { return bytes.size(); }
+
+    void byte(unsigned char b) { bytes.push_back(b); }
+
+    void bytes2(unsigned char a, unsigned char b) { byte(a); byte(b); }
+
+    void word(uint32_t w) {
+      for (int i = 0; i < 4; ++i) {
+        byte(w >> 8 * i);
+      }
+    }
+
+    // The opcode bytes of op, then a ModRM byte naming host register (or
+    // opcode extension) reg and the field at disp from rbx
+    void field(std::initializer_list<unsigned char> op, int reg,
+        uint32_t disp) {
+      for (unsigned char b : op) {
+        byte(b);
+      }
+      byte(0x80 | reg << 3 | 3);
+      word(disp);
+    }
+
+    // A rel32 jump (or jcc, given its opcode bytes) whose target is filled
+    // in later by patch; returns where
+    size_t jumpForward(std::initializer_list<unsigned char> op) {
+      for (unsigned char b : op) {
+        byte(b);
+      }
+      word(0);
+      return bytes.size() - 4;
+    }
+
+    // Points the jump at at to the current position
+    void patch(size_t at) {
+      uint32_t rel = bytes.size() - (at + 4);
+      memcpy(&bytes[at], &rel, 4);
+    }
+
+    // jmp to the shared exit code, filled in by place
+    void jumpToExit() {
+      byte(0xe9);
+      word(0);
+      exits.push_back(bytes.size() - 4);
+    }
+
+    // Points the jumps to the exit code from code put at origin
+    void place(const unsigned char *origin) {
+      for (size_t at : exits) {
+        uint32_t rel = exit - (origin + at + 4);
+        memcpy(&bytes[at], &rel, 4);
+      }
+    }
+};
+
+// Offsets of the fields of Machine that translated code uses
+struct Layout {
+  uint32_t registers, hi, lo, executed;
+  uint32_t reg(int r) const { return registers + 4 * r; }
+};
+
+} // namespace
+
+Jit::Jit(Machine &machine):
+  machine(machine), buffer(nullptr), capacity(bufferSize), used(0),
+  entrySize(0), blocks(nullptr), state(nullptr), translations(0) {
+#if defined(__x86_64__)
+  // Translation reads the decoded instructions, one word each, and
+  // watches stores to just the words it translated
+  machine.fuse(false);
+  const uint32_t words = machine.memorySize / 4;
+  void *p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  void *b = mmap(nullptr, (words + 1) * sizeof(void *) + words + 1,
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+    -1, 0);
+  if (p == MAP_FAILED || b == MAP_FAILED) {
+    int error = errno;
+    if (p != MAP_FAILED) {
+      munmap(p, capacity);
+    }
+    if (b != MAP_FAILED) {
+      munmap(b, (words + 1) * sizeof(void *) + words + 1);
+    }
+    throw ScanningFailure(std::string("ERROR: Cannot allocate translated "
+      "code: ") + strerror(error));
+  }
+  buffer = static_cast<unsigned char *>(p);
+  blocks = static_cast<void **>(b);
+  state = reinterpret_cast<uint8_t *>(blocks + words + 1);
+
+  // The entry code, called as
+  //   entry(machine, blocks, memory, state, block)
+  // saves the registers translated code uses, loads its own, and jumps to
+  // the block. Blocks leave through the exit code straight after, with
+  // what to return in rax.
+  static const unsigned char entry[] = {
+    0x53,                   // push rbx
+    0x55,                   // push rbp
+    0x41, 0x54,             // push r12
+    0x41, 0x55,             // push r13
+    0x41, 0x56,             // push r14
+    0x41, 0x57,             // push r15
+    0x48, 0x89, 0xfb,       // mov rbx, rdi
+    0x49, 0x89, 0xf4,       // mov r12, rsi
+    0x49, 0x89, 0xd5,       // mov r13, rdx
+    0x49, 0x89, 0xce,       // mov r14, rcx
+    0x41, 0xff, 0xe0,       // jmp r8
+    // exit:
+    0x41, 0x5f,             // pop r15
+    0x41, 0x5e,             // pop r14
+    0x41, 0x5d,             // pop r13
+    0x41, 0x5c,             // pop r12
+    0x5d,                   // pop rbp
+    0x5b,                   // pop rbx
+    0xc3                    // ret
+  };
+  memcpy(buffer, entry, sizeof(entry));
+  entrySize = sizeof(entry);
+  used = entrySize;
+  mprotect(buffer, capacity, PROT_READ | PROT_EXEC);
+#endif
+}
+
+Jit::~Jit() {
+  if (buffer != nullptr) {
+    const uint32_t words = machine.memorySize / 4;
+    munmap(buffer, capacity);
+    munmap(blocks, (words + 1) * sizeof(void *) + words + 1);
+  }
+}
+
+void Jit::cover(uint32_t index) {
+  if (state[index] == FREE) {
+    state[index] = COVERED;
+    translated.push_back(index);
+  }
+}
+
+void Jit::flush() {
+  for (uint32_t index : translated) {
+    if (state[index] == COVERED) {
+      state[index] = FREE;
+      // The interpreter's decoding may go stale now that stores to the
+      // word are no longer watched
+      machine.code[index].op = Machine::UNDECODED;
+    }
+    blocks[index] = nullptr;
+  }
+  translated.clear();
+  used = entrySize;
+}
+
+/* Translates the block starting at word index, returning its code, or
+ * nullptr if its first instruction has to be interpreted.
+ */
+void *Jit::translate(uint32_t index) {
+#if defined(__x86_64__)
+  typedef Machine::Instruction Instruction;
+  const uint32_t words = machine.memorySize / 4;
+  const uint32_t memorySize = machine.memorySize;
+  const Layout layout = {
+    offsetof(Machine, registers), offsetof(Machine, hi),
+    offsetof(Machine, lo), offsetof(Machine, executed)
+  };
+
+  // Find the instructions of the block
+  struct Item {
+    uint32_t index;
+    Instruction instr;
+  };
+  std::vector<Item> items;
+  uint32_t next = index;
+  while (items.size() < maxBlockLength && next < words
+      && state[next] != MODIFIED) {
+    if (machine.code[next].op == Machine::UNDECODED) {
+      machine.decode(next);
+    }
+    // Stores to every word decoded here must be watched, even to one that
+    // ends the block without being translated
+    cover(next);
+    Instruction instr = machine.code[next];
+    if (instr.op == Machine::INVALID || instr.op == Machine::NATIVE
+        || (instr.op == Machine::LIS
+          && (next + 1 >= words || state[next + 1] == MODIFIED))) {
+      break;
+    }
+    items.push_back(Item{next, instr});
+    next += instr.op == Machine::LIS ? 2 : 1;
+    if (instr.op == Machine::BEQ || instr.op == Machine::BNE
+        || instr.op == Machine::JR || instr.op == Machine::JALR) {
+      break;
+    }
+  }
+  if (items.empty()) {
+    return nullptr;
+  }
+
+  Emitter e(buffer + entrySize - 11);
+  const uint32_t n = items.size();
+
+  // Leaves the block to step the instruction at item k, which has not run
+  std::vector<std::pair<size_t, uint32_t>> slowPaths;
+  auto stepExit = [&](uint32_t k) {
+    e.field({0x48, 0x81}, 5, layout.executed);       // sub [executed], n-k
+    e.word(n - k);
+    e.bytes2(0x48, 0xb8);                             // mov rax, imm64
+    uint64_t value = stepFlag | items[k].index * 4;
+    for (int i = 0; i < 8; ++i) {
+      e.byte(value >> 8 * i);
+    }
+    e.jumpToExit();
+  };
+  auto slowPath = [&](std::initializer_list<unsigned char> op, uint32_t k) {
+    slowPaths.push_back(std::make_pair(e.jumpForward(op), k));
+  };
+
+  // Goes on to the block at word target: straight to its code if it has
+  // been translated, and otherwise back to run to translate it
+  auto chain = [&](uint32_t target) {
+    e.bytes2(0x49, 0x8b);                             // mov rcx, [r12 + d32]
+    e.bytes2(0x8c, 0x24);
+    e.word(target * 8);
+    e.byte(0x48);                                     // test rcx, rcx
+    e.bytes2(0x85, 0xc9);
+    e.bytes2(0x74, 0x02);                             // jz +2
+    e.bytes2(0xff, 0xe1);                             // jmp rcx
+    e.byte(0xb8);                                     // mov eax, target
+    e.word(target * 4);
+    e.jumpToExit();
+  };
+
+  // Checks the address in eax is an aligned word of memory
+  auto checkAddress = [&](uint32_t k) {
+    e.bytes2(0xa8, 0x03);                             // test al, 3
+    slowPath({0x0f, 0x85}, k);                        // jnz slow
+    e.byte(0x3d);                                     // cmp eax, size
+    e.word(memorySize);
+    slowPath({0x0f, 0x83}, k);                        // jae slow
+  };
+
+  e.field({0x48, 0x81}, 0, layout.executed);         // add [executed], n
+  e.word(n);
+
+  bool ended = false;
+  for (uint32_t k = 0; k < n; ++k) {
+    const Instruction &i = items[k].instr;
+    const uint32_t pc = items[k].index * 4;
+    switch (i.op) {
+      case Machine::ADD:
+      case Machine::SUB:
+        e.field({0x8b}, EAX, layout.reg(i.s));        // mov eax, [s]
+        e.field({static_cast<unsigned char>(i.op == Machine::ADD
+          ? 0x03 : 0x2b)}, EAX, layout.reg(i.t));     // add/sub eax, [t]
+        e.field({0x89}, EAX, layout.reg(i.d));        // mov [d], eax
+        break;
+      case Machine::SLT:
+      case Machine::SLTU:
+        e.field({0x8b}, EAX, layout.reg(i.s));        // mov eax, [s]
+        e.field({0x3b}, EAX, layout.reg(i.t));        // cmp eax, [t]
+        e.bytes2(0x0f, i.op == Machine::SLT
+          ? 0x9c : 0x92);                             // setl/setb al
+        e.byte(0xc0);
+        e.bytes2(0x0f, 0xb6);                         // movzx eax, al
+        e.byte(0xc0);
+        e.field({0x89}, EAX, layout.reg(i.d));        // mov [d], eax
+        break;
+      case Machine::MULT:
+      case Machine::MULTU:
+        e.field({0x8b}, EAX, layout.reg(i.s));        // mov eax, [s]
+        e.field({0xf7}, i.op == Machine::MULT
+          ? 5 : 4, layout.reg(i.t));                  // imul/mul [t]
+        e.field({0x89}, EAX, layout.lo);              // mov [lo], eax
+        e.field({0x89}, EDX, layout.hi);              // mov [hi], edx
+        break;
+      case Machine::DIV:
+      case Machine::DIVU:
+        // Division by 0 is an error, and INT_MIN / -1 traps on x86, so
+        // both are left to step
+        e.field({0x8b}, ECX, layout.reg(i.t));        // mov ecx, [t]
+        e.bytes2(0x85, 0xc9);                         // test ecx, ecx
+        slowPath({0x0f, 0x84}, k);                    // jz slow
+        if (i.op == Machine::DIV) {
+          e.bytes2(0x83, 0xf9);                       // cmp ecx, -1
+          e.byte(0xff);
+          slowPath({0x0f, 0x84}, k);                  // je slow
+        }
+        e.field({0x8b}, EAX, layout.reg(i.s));        // mov eax, [s]
+        if (i.op == Machine::DIV) {
+          e.byte(0x99);                               // cdq
+          e.bytes2(0xf7, 0xf9);                       // idiv ecx
+        }
+        else {
+          e.bytes2(0x31, 0xd2);                       // xor edx, edx
+          e.bytes2(0xf7, 0xf1);                       // div ecx
+        }
+        e.field({0x89}, EAX, layout.lo);              // mov [lo], eax
+        e.field({0x89}, EDX, layout.hi);              // mov [hi], edx
+        break;
+      case Machine::MFHI:
+      case Machine::MFLO:
+        e.field({0x8b}, EAX, i.op == Machine::MFHI
+          ? layout.hi : layout.lo);                   // mov eax, [hi/lo]
+        e.field({0x89}, EAX, layout.reg(i.d));        // mov [d], eax
+        break;
+      case Machine::LIS:
+        e.field({0xc7}, 0, layout.reg(i.d));          // mov [d], word
+        e.word(machine.memory[items[k].index + 1]);
+        break;
+      case Machine::LW:
+      case Machine::SW:
+        e.field({0x8b}, EAX, layout.reg(i.s));        // mov eax, [s]
+        e.byte(0x05);                                 // add eax, immediate
+        e.word(i.immediate);
+        checkAddress(k);
+        if (i.op == Machine::LW) {
+          e.bytes2(0x41, 0x8b);                       // mov ecx, [r13 + rax]
+          e.bytes2(0x4c, 0x05);
+          e.byte(0x00);
+          e.field({0x89}, ECX, layout.reg(i.d));      // mov [d], ecx
+        }
+        else {
+          // Stores to decoded words are left to step, which notices
+          e.bytes2(0x89, 0xc2);                       // mov edx, eax
+          e.bytes2(0xc1, 0xea);                       // shr edx, 2
+          e.byte(0x02);
+          e.bytes2(0x41, 0x80);                       // cmp [r14 + rdx], 0
+          e.bytes2(0x3c, 0x16);
+          e.byte(0x00);
+          slowPath({0x0f, 0x85}, k);                  // jne slow
+          e.field({0x8b}, ECX, layout.reg(i.t));      // mov ecx, [t]
+          e.bytes2(0x41, 0x89);                       // mov [r13 + rax], ecx
+          e.bytes2(0x4c, 0x05);
+          e.byte(0x00);
+        }
+        break;
+      case Machine::BEQ:
+      case Machine::BNE: {
+        e.field({0x8b}, EAX, layout.reg(i.s));        // mov eax, [s]
+        e.field({0x3b}, EAX, layout.reg(i.t));        // cmp eax, [t]
+        size_t notTaken = e.jumpForward({0x0f,
+          static_cast<unsigned char>(i.op == Machine::BEQ
+            ? 0x85 : 0x84)});                         // jne/je not taken
+        uint32_t target = items[k].index + 1 + i.immediate;
+        if (target < words) {
+          chain(target);
+        }
+        else {
+          stepExit(k);
+        }
+        e.patch(notTaken);
+        chain(items[k].index + 1);
+        ended = true;
+        break;
+      }
+      case Machine::JR:
+      case Machine::JALR:
+        // Jumps out of memory, including to the return address, are left
+        // to step
+        e.field({0x8b}, EAX, layout.reg(i.s));        // mov eax, [s]
+        checkAddress(k);
+        if (i.op == Machine::JALR) {
+          e.field({0xc7}, 0, layout.reg(31));         // mov [$31], pc + 4
+          e.word(pc + 4);
+        }
+        e.bytes2(0x89, 0xc1);                         // mov ecx, eax
+        e.bytes2(0xc1, 0xe9);                         // shr ecx, 2
+        e.byte(0x02);
+        e.bytes2(0x49, 0x8b);                         // mov rcx, [r12+rcx*8]
+        e.bytes2(0x0c, 0xcc);
+        e.byte(0x48);                                 // test rcx, rcx
+        e.bytes2(0x85, 0xc9);
+        e.bytes2(0x74, 0x02);                         // jz +2
+        e.bytes2(0xff, 0xe1);                         // jmp rcx
+        e.jumpToExit();                               // with eax = target
+        ended = true;
+        break;
+      default:
+        break;
+    }
+  }
+  if (!ended) {
+    chain(next);
+  }
+  for (auto &path : slowPaths) {
+    e.patch(path.first);
+    stepExit(path.second);
+  }
+
+  // Copy the code in, making just the pages it is on writable meanwhile.
+  // Only now is its size known, so only now can room be made for it.
+  if (used + e.size() > capacity) {
+    flush();
+  }
+  unsigned char *origin = buffer + used;
+  e.place(origin);
+  const size_t page = sysconf(_SC_PAGESIZE);
+  unsigned char *first = buffer + used / page * page;
+  size_t length = origin + e.size() - first;
+  mprotect(first, length, PROT_READ | PROT_WRITE);
+  memcpy(origin, e.code().data(), e.size());
+  mprotect(first, length, PROT_READ | PROT_EXEC);
+  used += (e.size() + 15) / 16 * 16;
+
+  // A flush above may have uncovered them
+  for (auto &item : items) {
+    cover(item.index);
+    if (item.instr.op == Machine::LIS) {
+      cover(item.index + 1);
+    }
+  }
+  blocks[index] = origin;
+  ++translations;
+  return origin;
+#else
+  return nullptr;
+#endif
+}
+
+void Jit::run(uint32_t pc) {
+  // Translated code keeps no profile or trace, so leave those to the
+  // interpreter
+  if (machine.instrumented()) {
+    machine.run(pc);
+    return;
+  }
+#if defined(__x86_64__)
+  typedef uint64_t (*Entry)(Machine *, void **, uint32_t *, uint8_t *,
+    void *);
+  const Entry entry = reinterpret_cast<Entry>(buffer);
+  const uint32_t words = machine.memorySize / 4;
+
+  if (pc != Machine::returnAddress
+      && (pc % 4 != 0 || pc >= machine.memorySize)) {
+    throw ScanningFailure("ERROR: Invalid jump to " + hex(pc));
+  }
+  while (pc != Machine::returnAddress) {
+    uint32_t index = pc / 4;
+    if (index < words && state[index] != MODIFIED) {
+      void *block = blocks[index];
+      if (block == nullptr) {
+        block = translate(index);
+      }
+      if (block != nullptr) {
+        uint64_t result = entry(&machine, blocks, machine.memory, state,
+          block);
+        pc = static_cast<uint32_t>(result);
+        if ((result & stepFlag) == 0) {
+          continue;
+        }
+        index = pc / 4;
+      }
+    }
+
+    // Interpret the instruction at pc, noticing any store to a decoded word
+    uint32_t stored = machine.memorySize;
+    if (index < words) {
+      cover(index);
+      if (machine.code[index].op == Machine::UNDECODED) {
+        machine.decode(index);
+      }
+      const Machine::Instruction &i = machine.code[index];
+      if (i.op == Machine::SW) {
+        stored = machine.registers[i.s] + i.immediate;
+      }
+    }
+    pc = machine.step(pc);
+    if (stored < machine.memorySize && stored % 4 == 0
+        && state[stored / 4] == COVERED) {
+      flush();
+      state[stored / 4] = MODIFIED;
+    }
+  }
+#else
+  machine.run(pc);
+#endif
+}
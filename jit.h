@@ -0,0 +1,57 @@
+#ifndef CS241_JIT_H
+#define CS241_JIT_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "mips.h"
+
+/* Runs a Machine by translating its code to x86-64, a basic block at a
+ * time, as each block is first reached. The MIPS registers stay in the
+ * Machine (the translated code addresses them directly), so the machine
+ * can switch between translated code and Machine::step at any
+ * instruction, and ends up in exactly the state Machine::run would leave
+ * it in.
+ *
+ * Translated blocks jump straight to each other through a table with an
+ * entry per word of memory. Anything unusual is left to Machine::step: I/O,
+ * errors, division by 0 or -1, jumps to the return address, and stores to
+ * a word that has been translated. Such a store throws every translation
+ * away, and the word it changed is interpreted from then on, so programs
+ * can still modify their own code.
+ *
+ * On other hosts, or if the machine is profiling or tracing, run just calls
+ * Machine::run. The interpreter does not fuse instructions on a machine
+ * with a Jit (see Machine::fuse).
+ */
+class Jit {
+    Machine &machine;
+    unsigned char *buffer;            // translated code, mapped executable
+    size_t capacity;
+    size_t used;
+    size_t entrySize;                 // the entry and exit code at the start
+    void **blocks;                    // translation of each word, if any
+    uint8_t *state;                   // whether each word is translated
+    std::vector<uint32_t> translated; // indices of the words with blocks
+    uint64_t translations;
+
+    void *translate(uint32_t index);
+    // Watches stores to the word at index, which has been decoded
+    void cover(uint32_t index);
+    void flush();
+
+  public:
+    explicit Jit(Machine &machine);
+    ~Jit();
+
+    Jit(const Jit &) = delete;
+    Jit &operator=(const Jit &) = delete;
+
+    // Runs from the instruction at pc until it jumps to returnAddress,
+    // like Machine::run.
+    void run(uint32_t pc);
+
+    // The number of blocks translated so far.
+    uint64_t blocksTranslated() const { return translations; }
+};
+
+#endif
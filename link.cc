@@ -0,0 +1,187 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include "scanner.h"
+#include "input.h"
+#include "symbols.h"
+#include "output.h"
+#include "merl.h"
+using namespace std;
+
+/*
+ * Links MERL objects produced by asm --merl into one.
+ *
+ * Usage: link [-o file] [--raw] [--symbols file] object.merl...
+ * The objects are laid out in the order given. Each import that another
+ * object exports is filled in; the rest are left for a later link. The
+ * result is a MERL object, or with --raw the bare machine code to be
+ * loaded at address 0, in which case every import must be resolved.
+ * Output goes to standard output, or to file if -o is given.
+ *
+ * --symbols file writes the exported labels and their addresses in the
+ * result to file, in the same form as asm's symbol table, for emu (which
+ * uses them to find the WLP4 runtime's procedures, among other things).
+ */
+
+// Reads the MERL object in the file at path
+MerlObject readObject(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    throw ScanningFailure("ERROR: Cannot read " + string(path));
+  }
+  unique_ptr<InputBuffer> input;
+  try {
+    input.reset(new InputBuffer(fd));
+  } catch (ScanningFailure &f) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+  return MerlObject::parse(input->data(), input->size(), path);
+}
+
+// Appends object to linked, moving its code to just after linked's code
+// and its exports into the table of exported symbols
+void append(MerlObject &linked, const MerlObject &object, Symbols &symbols,
+    vector<int64_t> &exports) {
+  uint32_t delta = linked.code.size() * 4;
+  linked.code.insert(linked.code.end(), object.code.begin(),
+    object.code.end());
+
+  for (uint32_t address : object.relocations) {
+    linked.code[(address + delta - MerlObject::codeStart) / 4] += delta;
+    linked.relocations.push_back(address + delta);
+  }
+  for (auto &symbol : object.references) {
+    linked.references.push_back(
+      MerlSymbol{symbol.name, symbol.address + delta});
+  }
+  for (auto &symbol : object.definitions) {
+    uint32_t id = symbols.intern(symbol.name);
+    exports.resize(symbols.size(), -1);
+    if (exports[id] >= 0) {
+      throw ScanningFailure("ERROR: Duplicate symbol " + symbol.name);
+    }
+    exports[id] = symbol.address + delta;
+    linked.definitions.push_back(
+      MerlSymbol{symbol.name, symbol.address + delta});
+  }
+}
+
+// Fills in every reference to an exported symbol, which then needs
+// relocating like any other address, and keeps the rest
+void resolve(MerlObject &linked, const Symbols &symbols,
+    const vector<int64_t> &exports) {
+  vector<MerlSymbol> unresolved;
+  for (auto &symbol : linked.references) {
+    uint32_t id = symbols.find(symbol.name.data(), symbol.name.size());
+    if (id == Symbols::noSymbol) {
+      unresolved.push_back(symbol);
+      continue;
+    }
+    linked.code[(symbol.address - MerlObject::codeStart) / 4] = exports[id];
+    linked.relocations.push_back(symbol.address);
+  }
+  linked.references.swap(unresolved);
+}
+
+// Prints how to run the linker, returning the exit status for misuse
+int usage(const char *name) {
+  cerr << "Usage: " << name << " [-o file] [--raw] [--symbols file]"
+    << " object.merl..." << endl;
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  vector<const char *> inputs;      // the objects to link, in order
+  const char *outputPath = nullptr; // where to write the result
+  bool raw = false;                 // whether to output bare machine code
+  const char *symbolsPath = nullptr; // where to list the exported labels
+
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "-o" && i + 1 < argc) {
+      outputPath = argv[++i];
+    }
+    else if (arg == "--raw") {
+      raw = true;
+    }
+    else if (arg == "--symbols" && i + 1 < argc) {
+      symbolsPath = argv[++i];
+    }
+    else if (arg.empty() || arg[0] != '-') {
+      inputs.push_back(argv[i]);
+    }
+    else {
+      cerr << "ERROR: Unrecognized argument " << arg << endl;
+      return usage(argv[0]);
+    }
+  }
+  if (inputs.empty()) {
+    // Most likely a build script left them out
+    cerr << "ERROR: No objects to link" << endl;
+    return usage(argv[0]);
+  }
+
+  try {
+    MerlObject linked;
+    Symbols symbols;                // names of exported symbols
+    vector<int64_t> exports;        // their addresses, indexed by id
+
+    for (const char *path : inputs) {
+      append(linked, readObject(path), symbols, exports);
+    }
+    resolve(linked, symbols, exports);
+
+    if (symbolsPath != nullptr) {
+      vector<MerlSymbol> labels = linked.definitions;
+      sort(labels.begin(), labels.end(),
+        [](const MerlSymbol &a, const MerlSymbol &b) {
+          return a.name < b.name;
+        });
+      ofstream listing(symbolsPath);
+      for (const MerlSymbol &label : labels) {
+        listing << label.name << " "
+          << label.address - (raw ? MerlObject::codeStart : 0) << "\n";
+      }
+      if (!listing.flush()) {
+        throw ScanningFailure("ERROR: Cannot write " + string(symbolsPath));
+      }
+    }
+
+    vector<uint32_t> words;
+    if (raw) {
+      if (!linked.references.empty()) {
+        throw ScanningFailure("ERROR: No such label: "
+          + linked.references.front().name);
+      }
+      // Move the code from just after the MERL header to address 0
+      for (uint32_t address : linked.relocations) {
+        linked.code[(address - MerlObject::codeStart) / 4] -=
+          MerlObject::codeStart;
+      }
+      words.swap(linked.code);
+    }
+    else {
+      words = linked.toWords();
+    }
+
+    if (outputPath != nullptr) {
+      writeWordsToFile(outputPath, words.data(), words.size());
+    }
+    else {
+      WordWriter writer(STDOUT_FILENO);
+      writer.write(words.data(), words.size());
+      writer.flush();
+    }
+  }
+  catch (ScanningFailure &f) {
+    cerr << f.what() << endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,119 @@
+#include "merl.h"
+#include "output.h"
+#include "scanner.h"
+
+const uint32_t MerlObject::cookie;
+const uint32_t MerlObject::codeStart;
+
+namespace {
+
+void appendSymbol(std::vector<uint32_t> &words, uint32_t type,
+    const MerlSymbol &symbol) {
+  words.push_back(type);
+  words.push_back(symbol.address);
+  words.push_back(symbol.name.size());
+  for (unsigned char c : symbol.name) {
+    words.push_back(c);
+  }
+}
+
+} // namespace
+
+std::vector<uint32_t> MerlObject::toWords() const {
+  std::vector<uint32_t> words = {cookie, 0, 0};
+  words.insert(words.end(), code.begin(), code.end());
+  words[2] = words.size() * 4;
+
+  for (uint32_t address : relocations) {
+    words.push_back(REL);
+    words.push_back(address);
+  }
+  for (auto &symbol : references) {
+    appendSymbol(words, ESR, symbol);
+  }
+  for (auto &symbol : definitions) {
+    appendSymbol(words, ESD, symbol);
+  }
+  words[1] = words.size() * 4;
+
+  return words;
+}
+
+MerlObject MerlObject::parse(const char *data, size_t size,
+    const std::string &source) {
+  auto fail = [&source](const std::string &problem) {
+    return ScanningFailure("ERROR: " + source + " is not a MERL file: "
+      + problem);
+  };
+
+  if (size % 4 != 0 || size < codeStart) {
+    throw fail("bad size");
+  }
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+  size_t numWords = size / 4;
+  auto word = [bytes](size_t i) { return loadBigEndian(bytes + 4 * i); };
+
+  if (word(0) != cookie) {
+    throw fail("bad header");
+  }
+  uint32_t endModule = word(1), endCode = word(2);
+  if (endModule != size || endCode < codeStart || endCode > endModule
+      || endCode % 4 != 0) {
+    throw fail("bad header");
+  }
+
+  MerlObject object;
+  for (size_t i = codeStart / 4; i < endCode / 4; ++i) {
+    object.code.push_back(word(i));
+  }
+
+  // Reads the ESR or ESD entry at word i, moving i past it
+  auto symbol = [&](size_t &i) {
+    if (i + 2 >= numWords || word(i + 2) > numWords - i - 3) {
+      throw fail("truncated entry");
+    }
+    MerlSymbol s{std::string(), word(i + 1)};
+    for (uint32_t k = 0, n = word(i + 2); k < n; ++k) {
+      s.name.push_back(static_cast<char>(word(i + 3 + k)));
+    }
+    i += 3 + s.name.size();
+    return s;
+  };
+
+  // Footer addresses must be those of words of code, except that a label
+  // may also be at the very end of the code
+  auto checkAddress = [&](uint32_t a, uint32_t last) {
+    if (a < codeStart || a > last || a % 4 != 0) {
+      throw fail("address out of range");
+    }
+  };
+
+  for (size_t i = endCode / 4; i < numWords;) {
+    switch (word(i)) {
+      case REL:
+        if (i + 1 >= numWords) {
+          throw fail("truncated entry");
+        }
+        checkAddress(word(i + 1), endCode - 4);
+        object.relocations.push_back(word(i + 1));
+        i += 2;
+        break;
+      case ESR: {
+        MerlSymbol s = symbol(i);
+        checkAddress(s.address, endCode - 4);
+        object.references.push_back(s);
+        break;
+      }
+      case ESD: {
+        MerlSymbol s = symbol(i);
+        checkAddress(s.address, endCode);
+        object.definitions.push_back(s);
+        break;
+      }
+      default:
+        throw fail("unknown footer entry");
+    }
+  }
+
+  return object;
+}
@@ -0,0 +1,53 @@
+#ifndef CS241_MERL_H
+#define CS241_MERL_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* A symbol of a MERL file: the name of an imported symbol with the address
+ * of the word that refers to it, or an exported label with its address.
+ */
+struct MerlSymbol {
+  std::string name;
+  uint32_t address;
+};
+
+/* A relocatable object in the MIPS Executable Relocatable Linkable format.
+ * A MERL file is a sequence of big-endian words:
+ *
+ *   0x10000002         beq $0, $0, 2, skipping the rest of the header
+ *   endModule          the size of the whole file in bytes
+ *   endCode            the size of the header and code in bytes
+ *   code               assembled as if loaded at address 0xc
+ *   footer entries     each one of
+ *     0x01 addr            REL: the word at addr holds an address
+ *     0x11 addr n c1..cn   ESR: the word at addr holds the address of the
+ *                          imported symbol named c1..cn (a character a word)
+ *     0x05 addr n c1..cn   ESD: the label named c1..cn is at addr
+ *
+ * Every address is an offset from the start of the file, so code[i] is at
+ * address codeStart + 4 * i.
+ */
+class MerlObject {
+  public:
+    static const uint32_t cookie = 0x10000002;
+    static const uint32_t codeStart = 12;
+
+    enum EntryType { REL = 0x01, ESR = 0x11, ESD = 0x05 };
+
+    std::vector<uint32_t> code;
+    std::vector<uint32_t> relocations;    // REL entries, by address
+    std::vector<MerlSymbol> references;   // ESR entries
+    std::vector<MerlSymbol> definitions;  // ESD entries
+
+    // Returns the words of the MERL file for this object.
+    std::vector<uint32_t> toWords() const;
+
+    // Parses the size bytes of a MERL file at data. Throws ScanningFailure,
+    // naming the file as source, if they are not a valid MERL file.
+    static MerlObject parse(const char *data, size_t size,
+        const std::string &source);
+};
+
+#endif
@@ -0,0 +1,631 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "mips.h"
+#include "output.h"
+#include "profile.h"
+#include "trace.h"
+#include "scanner.h"
+
+namespace {
+
+// Where writes to $0 go instead
+const uint8_t sink = 32;
+
+std::string hex(uint32_t word) {
+  char text[11];
+  snprintf(text, sizeof(text), "0x%08x", word);
+  return text;
+}
+
+void *mapZeroed(size_t size, const char *what) {
+  void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    throw ScanningFailure(std::string("ERROR: Cannot allocate ") + what
+      + ": " + strerror(errno));
+  }
+  return p;
+}
+
+} // namespace
+
+Machine::Machine(uint32_t size):
+  memorySize(size - size % 4), memory(nullptr), code(nullptr), hi(0), lo(0),
+  executed(0), executions(nullptr), transfers(nullptr),
+  calls(nullptr), tracer(nullptr), fusing(true) {
+  memory = static_cast<uint32_t *>(mapZeroed(memorySize, "memory"));
+  try {
+    code = static_cast<Instruction *>(mapZeroed(
+      (memorySize / 4 + 1) * sizeof(Instruction), "decoded instructions"));
+  } catch (ScanningFailure &f) {
+    munmap(memory, memorySize);
+    throw;
+  }
+  // Running off the end of memory runs this
+  code[memorySize / 4].op = END;
+  memset(registers, 0, sizeof(registers));
+}
+
+Machine::~Machine() {
+  if (executions != nullptr) {
+    munmap(executions, (memorySize / 4 + 1) * sizeof(uint64_t));
+    munmap(transfers, (memorySize / 4 + 1) * sizeof(uint64_t));
+  }
+  munmap(code, (memorySize / 4 + 1) * sizeof(Instruction));
+  munmap(memory, memorySize);
+}
+
+void Machine::load(const unsigned char *bytes, size_t count,
+    uint32_t address) {
+  if (address % 4 != 0 || address > memorySize
+      || count > (memorySize - address) / 4) {
+    throw ScanningFailure("ERROR: Program does not fit in memory at "
+      + hex(address));
+  }
+  for (size_t i = 0; i < count; ++i, bytes += 4) {
+    memory[address / 4 + i] = loadBigEndian(bytes);
+    invalidate(address / 4 + i);
+  }
+}
+
+void Machine::map(int fd, size_t bytes, uint32_t address) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  if (address % page != 0 || address > memorySize
+      || bytes > memorySize - address) {
+    throw ScanningFailure("ERROR: File does not fit in memory at "
+      + hex(address));
+  }
+  if (bytes == 0) {
+    return;
+  }
+  // The last page may be partly past the end of the file, which reads as
+  // zeroes, but not past the end of memory
+  const size_t length = std::min((bytes + page - 1) / page * page,
+    static_cast<size_t>(memorySize - address));
+  if (mmap(memory + address / 4, length, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    throw ScanningFailure(std::string("ERROR: Cannot map file: ")
+      + strerror(errno));
+  }
+  // Likewise replace the words' decoded records with zeroed (undecoded)
+  // ones, rather than touching each
+  const size_t records = (length / 4 * sizeof(Instruction) + page - 1)
+    / page * page;
+  if (mmap(code + address / 4, records, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0)
+      == MAP_FAILED) {
+    throw ScanningFailure(std::string("ERROR: Cannot map file: ")
+      + strerror(errno));
+  }
+  if (address / 4 + records / sizeof(Instruction) > memorySize / 4) {
+    code[memorySize / 4].op = END;
+  }
+  invalidate(address / 4);
+}
+
+void Machine::enableProfiling() {
+  if (executions != nullptr) {
+    return;
+  }
+  // Like code, these have a last entry for running off the end of memory
+  const size_t size = (memorySize / 4 + 1) * sizeof(uint64_t);
+  uint64_t *counts = static_cast<uint64_t *>(mapZeroed(size, "profile"));
+  try {
+    transfers = static_cast<uint64_t *>(mapZeroed(size, "profile"));
+  } catch (ScanningFailure &f) {
+    munmap(counts, size);
+    throw;
+  }
+  executions = counts;
+}
+
+void Machine::hook(uint32_t address, Native procedure) {
+  if (address % 4 != 0 || address >= memorySize) {
+    throw ScanningFailure("ERROR: Cannot run a procedure at "
+      + hex(address));
+  }
+  natives.emplace_back(address / 4, std::move(procedure));
+  invalidate(address / 4);
+}
+
+void Machine::fuse(bool on) {
+  if (fusing && !on) {
+    for (uint32_t index = 0; index < memorySize / 4; ++index) {
+      if (code[index].op >= PUSH) {
+        code[index].op = UNDECODED;
+      }
+    }
+  }
+  fusing = on;
+}
+
+void Machine::traceCalls(CallGraph *graph) {
+  enableProfiling();
+  calls = graph;
+}
+
+bool Machine::hooked(uint32_t index) const {
+  for (auto &native : natives) {
+    if (native.first == index) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Machine::decode(uint32_t index) {
+  uint32_t word = memory[index];
+  Instruction &instr = code[index];
+  for (size_t n = 0; n < natives.size(); ++n) {
+    if (natives[n].first == index) {
+      instr = Instruction{NATIVE, 31, 0, 0, static_cast<int32_t>(n)};
+      return;
+    }
+  }
+  uint8_t s = word >> 21 & 31, t = word >> 16 & 31, d = word >> 11 & 31;
+  instr.s = s;
+  instr.t = t;
+  instr.d = d == 0 ? sink : d;
+  instr.immediate = static_cast<int16_t>(word & 0xffff);
+  instr.op = INVALID;
+
+  switch (word >> 26) {
+    case 0:
+      // Register instructions, told apart by their low 11 bits, with each
+      // field the assembler leaves out required to be 0
+      switch (word & 0x7ff) {
+        case 32: instr.op = ADD; break;
+        case 34: instr.op = SUB; break;
+        case 42: instr.op = SLT; break;
+        case 43: instr.op = SLTU; break;
+        case 24: instr.op = d == 0 ? MULT : INVALID; break;
+        case 25: instr.op = d == 0 ? MULTU : INVALID; break;
+        case 26: instr.op = d == 0 ? DIV : INVALID; break;
+        case 27: instr.op = d == 0 ? DIVU : INVALID; break;
+        case 16: instr.op = s == 0 && t == 0 ? MFHI : INVALID; break;
+        case 18: instr.op = s == 0 && t == 0 ? MFLO : INVALID; break;
+        case 20: instr.op = s == 0 && t == 0 ? LIS : INVALID; break;
+        case 8: instr.op = t == 0 && d == 0 ? JR : INVALID; break;
+        case 9: instr.op = t == 0 && d == 0 ? JALR : INVALID; break;
+      }
+      break;
+    case 4: instr.op = BEQ; break;
+    case 5: instr.op = BNE; break;
+    case 35:
+      // Loads write $t, which goes in d like every other destination
+      instr.op = LW;
+      instr.d = t == 0 ? sink : t;
+      break;
+    case 43: instr.op = SW; break;
+  }
+
+  // Fuse a push or pop with the add or sub that moves its base register
+  // (any but $0) after it. Stores to the next word undo this (see
+  // invalidate).
+  if (!fusing || (instr.op != LW && instr.op != SW) || s == 0
+      || index + 1 >= memorySize / 4 || hooked(index + 1)) {
+    return;
+  }
+  const uint32_t next = memory[index + 1];
+  const uint32_t adjust = s << 21 | s << 11 | (instr.op == SW ? 34 : 32);
+  if ((next & ~(31u << 16)) == adjust) {
+    if (instr.op == SW) {
+      instr.op = PUSH;
+      instr.d = next >> 16 & 31;
+    }
+    else {
+      instr.op = POP;
+      instr.t = next >> 16 & 31;
+    }
+  }
+}
+
+void Machine::run(uint32_t start) {
+  if (tracer != nullptr) {
+    if (executions != nullptr) {
+      execute<true, true>(start);
+    }
+    else {
+      execute<false, true>(start);
+    }
+  }
+  else if (executions != nullptr) {
+    execute<true, false>(start);
+  }
+  else {
+    execute<false, false>(start);
+  }
+}
+
+/* The interpreter. Each handler ends by jumping straight to the handler of
+ * the next instruction (GCC's computed goto), which predicts better than a
+ * single switch and saves its bounds check. pc is the index of the running
+ * instruction in memory and code. Profiling and tracing are template
+ * parameters so that they cost nothing when they are off.
+ */
+template <bool profiling, bool tracing>
+void Machine::execute(uint32_t start) {
+  static void *const handlers[] = {
+    &&undecoded, &&add, &&sub, &&slt, &&sltu, &&mult, &&multu, &&div,
+    &&divu, &&mfhi, &&mflo, &&lis, &&jr, &&jalr, &&beq, &&bne, &&lw, &&sw,
+    &&invalid, &&end, &&native, &&push, &&pop
+  };
+
+  uint32_t *const r = registers;
+  uint32_t *const mem = memory;
+  Instruction *const code = this->code;
+  const uint32_t words = memorySize / 4;
+  uint64_t *const executions = this->executions;
+  uint64_t *const transfers = this->transfers;
+  TraceWriter *const tracer = this->tracer;
+  uint64_t count = executed;
+  uint32_t pc = 0;
+  uint32_t target = start;
+  uint32_t address;
+  const Instruction *i;
+  std::string problem;
+
+#define DISPATCH() do { \
+    i = &code[pc]; ++count; \
+    if (profiling) ++executions[pc]; \
+    if (tracing) tracer->instruction(pc * 4); \
+    goto *handlers[i->op]; \
+  } while (0)
+#define TAKEN() do { if (profiling) ++transfers[pc]; } while (0)
+// Moves on to the second instruction of a PUSH or POP
+#define SECOND() do { \
+    ++pc; ++count; \
+    if (profiling) ++executions[pc]; \
+    if (tracing) tracer->instruction(pc * 4); \
+  } while (0)
+#define NEXT() do { ++pc; DISPATCH(); } while (0)
+#define FAULT(message) do { problem = message; goto fault; } while (0)
+
+  goto jump;
+
+undecoded:
+  decode(pc);
+  goto *handlers[i->op];
+add:
+  r[i->d] = r[i->s] + r[i->t];
+  NEXT();
+sub:
+  r[i->d] = r[i->s] - r[i->t];
+  NEXT();
+slt:
+  r[i->d] = static_cast<int32_t>(r[i->s]) < static_cast<int32_t>(r[i->t]);
+  NEXT();
+sltu:
+  r[i->d] = r[i->s] < r[i->t];
+  NEXT();
+mult:
+  {
+    int64_t product = static_cast<int64_t>(static_cast<int32_t>(r[i->s]))
+      * static_cast<int32_t>(r[i->t]);
+    hi = static_cast<uint64_t>(product) >> 32;
+    lo = product;
+  }
+  NEXT();
+multu:
+  {
+    uint64_t product = static_cast<uint64_t>(r[i->s]) * r[i->t];
+    hi = product >> 32;
+    lo = product;
+  }
+  NEXT();
+div:
+  if (r[i->t] == 0) {
+    FAULT("ERROR: Division by zero at " + hex(pc * 4));
+  }
+  if (r[i->t] == 0xffffffff) {
+    // Dividing INT_MIN by -1 overflows in C++, but not on MIPS
+    lo = -r[i->s];
+    hi = 0;
+  }
+  else {
+    lo = static_cast<int32_t>(r[i->s]) / static_cast<int32_t>(r[i->t]);
+    hi = static_cast<int32_t>(r[i->s]) % static_cast<int32_t>(r[i->t]);
+  }
+  NEXT();
+divu:
+  if (r[i->t] == 0) {
+    FAULT("ERROR: Division by zero at " + hex(pc * 4));
+  }
+  lo = r[i->s] / r[i->t];
+  hi = r[i->s] % r[i->t];
+  NEXT();
+mfhi:
+  r[i->d] = hi;
+  NEXT();
+mflo:
+  r[i->d] = lo;
+  NEXT();
+lis:
+  if (pc + 1 >= words) {
+    FAULT("ERROR: lis at the end of memory at " + hex(pc * 4));
+  }
+  r[i->d] = mem[pc + 1];
+  pc += 2;
+  DISPATCH();
+jr:
+  TAKEN();
+  target = r[i->s];
+  if (profiling && calls != nullptr) {
+    calls->jump(target, count);
+  }
+  goto jump;
+jalr:
+  TAKEN();
+  target = r[i->s];
+  if (profiling && calls != nullptr) {
+    calls->call(target, (pc + 1) * 4, count);
+  }
+  r[31] = (pc + 1) * 4;
+  goto jump;
+beq:
+  if (r[i->s] != r[i->t]) {
+    NEXT();
+  }
+  TAKEN();
+  pc += 1 + i->immediate;
+  if (pc >= words) {
+    FAULT("ERROR: Branch out of memory to " + hex(pc * 4));
+  }
+  DISPATCH();
+bne:
+  if (r[i->s] == r[i->t]) {
+    NEXT();
+  }
+  TAKEN();
+  pc += 1 + i->immediate;
+  if (pc >= words) {
+    FAULT("ERROR: Branch out of memory to " + hex(pc * 4));
+  }
+  DISPATCH();
+lw:
+  address = r[i->s] + i->immediate;
+  if (address < memorySize && address % 4 == 0) {
+    r[i->d] = mem[address / 4];
+  }
+  else if (address == inputAddress) {
+    r[i->d] = getchar_unlocked();
+  }
+  else {
+    FAULT("ERROR: Invalid load from " + hex(address) + " at " + hex(pc * 4));
+  }
+  if (tracing) {
+    tracer->load(address, r[i->d]);
+  }
+  NEXT();
+sw:
+  address = r[i->s] + i->immediate;
+  if (address < memorySize && address % 4 == 0) {
+    mem[address / 4] = r[i->t];
+    invalidate(address / 4);
+  }
+  else if (address == outputAddress) {
+    putchar_unlocked(r[i->t] & 0xff);
+  }
+  else {
+    FAULT("ERROR: Invalid store to " + hex(address) + " at " + hex(pc * 4));
+  }
+  if (tracing) {
+    tracer->store(address, r[i->t]);
+  }
+  NEXT();
+native:
+  // The procedure may fail, so the count must be up to date
+  executed = count;
+  natives[i->immediate].second(*this);
+  goto jr;
+push:
+  // A store that is not to an ordinary word, or that changes this pair, is
+  // left to sw, with the sub run on its own after
+  address = r[i->s] + i->immediate;
+  if (address >= memorySize || address % 4 != 0 || address / 4 - pc < 2) {
+    goto sw;
+  }
+  mem[address / 4] = r[i->t];
+  invalidate(address / 4);
+  if (tracing) {
+    tracer->store(address, r[i->t]);
+  }
+  SECOND();
+  r[i->s] -= r[i->d];
+  NEXT();
+pop:
+  address = r[i->s] + i->immediate;
+  if (address >= memorySize || address % 4 != 0) {
+    goto lw;
+  }
+  r[i->d] = mem[address / 4];
+  if (tracing) {
+    tracer->load(address, r[i->d]);
+  }
+  SECOND();
+  r[i->s] += r[i->t];
+  NEXT();
+invalid:
+  FAULT("ERROR: Invalid instruction " + hex(mem[pc]) + " at " + hex(pc * 4));
+end:
+  FAULT("ERROR: Ran off the end of memory");
+
+jump:
+  if (target == returnAddress) {
+    executed = count;
+    return;
+  }
+  if (target % 4 != 0 || target >= memorySize) {
+    FAULT("ERROR: Invalid jump to " + hex(target)
+      + (count == executed ? "" : " at " + hex(pc * 4)));
+  }
+  pc = target / 4;
+  DISPATCH();
+
+fault:
+  executed = count;
+  throw ScanningFailure(problem);
+
+#undef DISPATCH
+#undef NEXT
+#undef FAULT
+#undef TAKEN
+#undef SECOND
+}
+
+uint32_t Machine::step(uint32_t pc) {
+  const uint32_t index = pc / 4;
+  ++executed;
+  if (executions != nullptr) {
+    ++executions[index];
+  }
+  if (tracer != nullptr) {
+    tracer->instruction(pc);
+  }
+  if (index == memorySize / 4) {
+    throw ScanningFailure("ERROR: Ran off the end of memory");
+  }
+  if (code[index].op == UNDECODED) {
+    decode(index);
+  }
+  const Instruction &i = code[index];
+  uint32_t *const r = registers;
+  uint32_t address, target;
+
+  switch (i.op) {
+    case ADD: r[i.d] = r[i.s] + r[i.t]; break;
+    case SUB: r[i.d] = r[i.s] - r[i.t]; break;
+    case SLT:
+      r[i.d] = static_cast<int32_t>(r[i.s]) < static_cast<int32_t>(r[i.t]);
+      break;
+    case SLTU: r[i.d] = r[i.s] < r[i.t]; break;
+    case MULT: {
+      int64_t product = static_cast<int64_t>(static_cast<int32_t>(r[i.s]))
+        * static_cast<int32_t>(r[i.t]);
+      hi = static_cast<uint64_t>(product) >> 32;
+      lo = product;
+      break;
+    }
+    case MULTU: {
+      uint64_t product = static_cast<uint64_t>(r[i.s]) * r[i.t];
+      hi = product >> 32;
+      lo = product;
+      break;
+    }
+    case DIV:
+      if (r[i.t] == 0) {
+        throw ScanningFailure("ERROR: Division by zero at " + hex(pc));
+      }
+      if (r[i.t] == 0xffffffff) {
+        lo = -r[i.s];
+        hi = 0;
+      }
+      else {
+        lo = static_cast<int32_t>(r[i.s]) / static_cast<int32_t>(r[i.t]);
+        hi = static_cast<int32_t>(r[i.s]) % static_cast<int32_t>(r[i.t]);
+      }
+      break;
+    case DIVU:
+      if (r[i.t] == 0) {
+        throw ScanningFailure("ERROR: Division by zero at " + hex(pc));
+      }
+      lo = r[i.s] / r[i.t];
+      hi = r[i.s] % r[i.t];
+      break;
+    case MFHI: r[i.d] = hi; break;
+    case MFLO: r[i.d] = lo; break;
+    case LIS:
+      if (index + 1 >= memorySize / 4) {
+        throw ScanningFailure("ERROR: lis at the end of memory at " + hex(pc));
+      }
+      r[i.d] = memory[index + 1];
+      return pc + 8;
+    case NATIVE:
+      natives[i.immediate].second(*this);
+      // Then return, like jr $31
+      // fall through
+    case JR:
+    case JALR:
+      if (transfers != nullptr) {
+        ++transfers[index];
+      }
+      target = r[i.s];
+      if (calls != nullptr) {
+        if (i.op == JALR) {
+          calls->call(target, pc + 4, executed);
+        }
+        else {
+          calls->jump(target, executed);
+        }
+      }
+      if (i.op == JALR) {
+        r[31] = pc + 4;
+      }
+      if (target == returnAddress) {
+        return target;
+      }
+      if (target % 4 != 0 || target >= memorySize) {
+        throw ScanningFailure("ERROR: Invalid jump to " + hex(target) + " at "
+          + hex(pc));
+      }
+      return target;
+    case BEQ:
+    case BNE:
+      if ((r[i.s] == r[i.t]) != (i.op == BEQ)) {
+        break;
+      }
+      if (transfers != nullptr) {
+        ++transfers[index];
+      }
+      target = (index + 1 + i.immediate) * 4;
+      if (index + 1 + i.immediate >= memorySize / 4) {
+        throw ScanningFailure("ERROR: Branch out of memory to "
+          + hex(target));
+      }
+      return target;
+    case LW:
+    case POP:
+      address = r[i.s] + i.immediate;
+      if (address < memorySize && address % 4 == 0) {
+        r[i.d] = memory[address / 4];
+      }
+      else if (address == inputAddress) {
+        r[i.d] = getchar_unlocked();
+      }
+      else {
+        throw ScanningFailure("ERROR: Invalid load from " + hex(address)
+          + " at " + hex(pc));
+      }
+      if (tracer != nullptr) {
+        tracer->load(address, r[i.d]);
+      }
+      break;
+    case SW:
+    case PUSH:
+      address = r[i.s] + i.immediate;
+      if (address < memorySize && address % 4 == 0) {
+        memory[address / 4] = r[i.t];
+        invalidate(address / 4);
+      }
+      else if (address == outputAddress) {
+        putchar_unlocked(r[i.t] & 0xff);
+      }
+      else {
+        throw ScanningFailure("ERROR: Invalid store to " + hex(address)
+          + " at " + hex(pc));
+      }
+      if (tracer != nullptr) {
+        tracer->store(address, r[i.t]);
+      }
+      break;
+    default:
+      throw ScanningFailure("ERROR: Invalid instruction " + hex(memory[index])
+        + " at " + hex(pc));
+  }
+  return pc + 4;
+}
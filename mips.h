@@ -0,0 +1,159 @@
+#ifndef CS241_MIPS_H
+#define CS241_MIPS_H
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+class CallGraph;
+class TraceWriter;
+
+/* An emulated MIPS machine running exactly the instructions the assembler
+ * encodes (see opcodes.cc), with the CS241 conventions: loading a word from
+ * inputAddress reads a byte from standard input (-1 at end of file),
+ * storing a word to outputAddress writes its low byte to standard output,
+ * and jumping to returnAddress stops the machine.
+ *
+ * Memory is a flat array of words in host byte order. Each word is decoded
+ * the first time it is executed, into a record that the interpreter
+ * dispatches on directly from then on; storing to a word throws its record
+ * away, so programs may still modify their own code. Errors (bad
+ * instructions, unaligned or out of range accesses, division by zero) stop
+ * the machine with a ScanningFailure.
+ */
+class Machine {
+  public:
+    static const uint32_t returnAddress = 0x8123456c;
+    static const uint32_t inputAddress = 0xffff0004;
+    static const uint32_t outputAddress = 0xffff000c;
+    static const uint32_t defaultMemorySize = 0x01000000;
+
+    // What a decoded instruction does. UNDECODED must be 0, so that freshly
+    // mapped (zeroed) records are decoded before they are run. NATIVE runs
+    // a procedure of the host's (see hook). PUSH and POP, which must come
+    // last, are pairs of instructions run as one.
+    enum Op : uint8_t {
+      UNDECODED, ADD, SUB, SLT, SLTU, MULT, MULTU, DIV, DIVU, MFHI, MFLO,
+      LIS, JR, JALR, BEQ, BNE, LW, SW, INVALID, END, NATIVE, PUSH, POP
+    };
+
+    // A procedure the host runs in place of MIPS code
+    typedef std::function<void(Machine &)> Native;
+
+    // A decoded instruction. The register fields hold register numbers,
+    // with any write to $0 redirected to a register nobody reads. A PUSH
+    // is a SW whose d is the register the next instruction subtracts from
+    // its base register, and a POP is a LW whose t is the register the next
+    // instruction adds to its base register. A NATIVE's immediate is its
+    // index in natives, and its s is 31, as it returns like jr $31.
+    struct Instruction {
+      uint8_t op;
+      uint8_t s, t, d;
+      int32_t immediate;
+    };
+
+  private:
+    uint32_t memorySize;              // in bytes, a multiple of 4
+    uint32_t *memory;
+    Instruction *code;                // one per word of memory, and one more
+    uint32_t registers[33];           // $0 to $31, then the sink for $0
+    uint32_t hi, lo;
+    uint64_t executed;
+    uint64_t *executions;             // per word, if profiling, else null
+    uint64_t *transfers;              // likewise, branches taken and jumps
+    CallGraph *calls;                 // told of calls and returns, if not null
+    TraceWriter *tracer;              // told of everything, if not null
+    bool fusing;                      // whether decode makes PUSH and POP
+    std::vector<std::pair<uint32_t, Native>> natives;  // by word index
+
+    // The interpreter, counting into executions and transfers if profiling,
+    // and recording to tracer if tracing
+    template <bool profiling, bool tracing> void execute(uint32_t start);
+
+    // Decodes the word at index into code[index]
+    void decode(uint32_t index);
+
+    // Whether a procedure of the host's runs at word index
+    bool hooked(uint32_t index) const;
+
+    // Notes that the word at index has changed
+    void invalidate(uint32_t index) {
+      code[index].op = UNDECODED;
+      if (index != 0 && code[index - 1].op >= PUSH) {
+        code[index - 1].op = UNDECODED;
+      }
+    }
+
+    // The translator reads the state above directly
+    friend class Jit;
+
+  public:
+    // A machine with size bytes of zeroed memory and zeroed registers.
+    explicit Machine(uint32_t size = defaultMemorySize);
+    ~Machine();
+
+    Machine(const Machine &) = delete;
+    Machine &operator=(const Machine &) = delete;
+
+    uint32_t size() const { return memorySize; }
+
+    // The word at address, which must be aligned and in memory
+    uint32_t &word(uint32_t address) { return memory[address / 4]; }
+
+    // Copies count big-endian words to memory from address on.
+    void load(const unsigned char *bytes, size_t count, uint32_t address);
+
+    // Maps the first bytes bytes of the file open as fd, which hold words in
+    // the host's byte order, into memory from address on, which must be a
+    // multiple of the page size. Nothing is copied: pages are read from the
+    // file when first touched, and changes to them are not written back.
+    void map(int fd, size_t bytes, uint32_t address);
+
+    uint32_t &reg(int r) { return registers[r]; }
+
+    // Runs from the instruction at pc until it jumps to returnAddress.
+    void run(uint32_t pc);
+
+    // Runs just the instruction at pc, which must be aligned and no more
+    // than the size of memory, returning the address of the next one (which
+    // is returnAddress if the machine has stopped). Slower than run, but
+    // exactly equivalent.
+    uint32_t step(uint32_t pc);
+
+    // The number of instructions run so far.
+    uint64_t instructions() const { return executed; }
+
+    // Counts, from now on, how many times each instruction runs and how many
+    // times it branches or jumps, at some cost in speed.
+    void enableProfiling();
+
+    // Tells graph of every jalr and jr from now on, which enables profiling.
+    void traceCalls(CallGraph *graph);
+
+    // Whether to run the pairs of instructions wlp4gen uses to push and pop
+    // ($b is usually $30, and $c $4),
+    //   sw $t, i($b)          lw $t, i($b)
+    //   sub $b, $b, $c        add $b, $b, $c
+    // as one, which saves the interpreter a dispatch. On by default.
+    void fuse(bool on);
+
+    // Runs procedure whenever the program reaches address, instead of the
+    // instruction there, then returns to $31 as jr $31 would. It counts as
+    // one instruction, and may fail with a ScanningFailure.
+    void hook(uint32_t address, Native procedure);
+
+    // Records every instruction from now on with writer (see trace.h).
+    void trace(TraceWriter *writer) { tracer = writer; }
+
+    // Whether profiling or tracing, which only the interpreters do.
+    bool instrumented() const {
+      return executions != nullptr || tracer != nullptr;
+    }
+
+    // Those counts, indexed by word of memory, or null if not profiling.
+    const uint64_t *executionCounts() const { return executions; }
+    const uint64_t *takenCounts() const { return transfers; }
+};
+
+#endif
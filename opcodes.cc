@@ -0,0 +1,117 @@
+#include <cstring>
+#include "opcodes.h"
+
+namespace {
+
+const int8_t IMM = Opcode::immediateField;
+
+// Bits shared by each group of instructions
+constexpr uint32_t op(uint32_t opcode) { return opcode << 26; }
+
+constexpr Opcode opcodeTable[] = {
+  // mnemonic operands bits      fields           immediate      pcRelative
+  {"add",   "r,r,r",  32,        {11, 21, 16},    Opcode::NONE,  false},
+  {"sub",   "r,r,r",  34,        {11, 21, 16},    Opcode::NONE,  false},
+  {"slt",   "r,r,r",  42,        {11, 21, 16},    Opcode::NONE,  false},
+  {"sltu",  "r,r,r",  43,        {11, 21, 16},    Opcode::NONE,  false},
+  {"mult",  "r,r",    24,        {21, 16},        Opcode::NONE,  false},
+  {"multu", "r,r",    25,        {21, 16},        Opcode::NONE,  false},
+  {"div",   "r,r",    26,        {21, 16},        Opcode::NONE,  false},
+  {"divu",  "r,r",    27,        {21, 16},        Opcode::NONE,  false},
+  {"mfhi",  "r",      16,        {11},            Opcode::NONE,  false},
+  {"mflo",  "r",      18,        {11},            Opcode::NONE,  false},
+  {"lis",   "r",      20,        {11},            Opcode::NONE,  false},
+  {"jr",    "r",      8,         {21},            Opcode::NONE,  false},
+  {"jalr",  "r",      9,         {21},            Opcode::NONE,  false},
+  {"beq",   "r,r,l",  op(4),     {21, 16, IMM},   Opcode::HALF,  true},
+  {"bne",   "r,r,l",  op(5),     {21, 16, IMM},   Opcode::HALF,  true},
+  {"lw",    "r,i(r)", op(35),    {16, IMM, 21},   Opcode::HALF,  false},
+  {"sw",    "r,i(r)", op(43),    {16, IMM, 21},   Opcode::HALF,  false},
+};
+
+const size_t numOpcodes = sizeof(opcodeTable) / sizeof(opcodeTable[0]);
+
+/* The mnemonic hash. The constants were found by search so that every
+ * mnemonic in the table lands in a different one of the 32 slots; this
+ * is checked at compile time below.
+ */
+const size_t hashSlots = 32;
+
+constexpr size_t hashMnemonic(const char *mnemonic, size_t length) {
+  return (static_cast<unsigned char>(mnemonic[0])
+      + 3 * static_cast<unsigned char>(mnemonic[length - 1])
+      + length) % hashSlots;
+}
+
+constexpr size_t constexprLength(const char *s) {
+  size_t length = 0;
+  while (s[length] != '\0') {
+    ++length;
+  }
+  return length;
+}
+
+struct HashTable {
+  int8_t slot[hashSlots];
+  bool perfect;
+};
+
+constexpr HashTable buildHashTable() {
+  HashTable table{};
+  table.perfect = true;
+
+  for (size_t i = 0; i < hashSlots; ++i) {
+    table.slot[i] = -1;
+  }
+  for (size_t i = 0; i < numOpcodes; ++i) {
+    const char *mnemonic = opcodeTable[i].mnemonic;
+    size_t h = hashMnemonic(mnemonic, constexprLength(mnemonic));
+    if (table.slot[h] != -1) {
+      table.perfect = false;
+    }
+    table.slot[h] = i;
+  }
+  return table;
+}
+
+constexpr HashTable hashTable = buildHashTable();
+static_assert(hashTable.perfect,
+    "mnemonic hash collides; pick new constants for hashMnemonic");
+
+} // namespace
+
+int Opcode::numOperands() const {
+  int count = 0;
+  for (const char *p = operands; *p != '\0'; ++p) {
+    if (*p == 'r' || *p == 'i' || *p == 'l') {
+      ++count;
+    }
+  }
+  return count;
+}
+
+uint32_t Opcode::encode(const int64_t *ops) const {
+  uint32_t instr = bits;
+  int count = numOperands();
+
+  for (int i = 0; i < count; ++i) {
+    if (fields[i] != immediateField) {
+      instr |= static_cast<uint32_t>(ops[i]) << fields[i];
+    } else {
+      instr |= static_cast<uint32_t>(ops[i]) & 0xffff;
+    }
+  }
+  return instr;
+}
+
+const Opcode *findOpcode(const char *mnemonic, size_t length) {
+  if (length == 0) {
+    return nullptr;
+  }
+  int i = hashTable.slot[hashMnemonic(mnemonic, length)];
+  if (i < 0 || strlen(opcodeTable[i].mnemonic) != length
+      || memcmp(opcodeTable[i].mnemonic, mnemonic, length) != 0) {
+    return nullptr;
+  }
+  return &opcodeTable[i];
+}
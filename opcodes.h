@@ -0,0 +1,56 @@
+#ifndef CS241_OPCODES_H
+#define CS241_OPCODES_H
+#include <cstddef>
+#include <cstdint>
+
+/* Describes one instruction of the assembly language. Everything the
+ * assembler needs to check and encode an instruction is in this table, so
+ * adding an instruction is a matter of adding a row. (Data directives such
+ * as .word are handled by the assembler itself, since they can produce any
+ * number of words.)
+ *
+ * operands is the operand signature, one character per token expected
+ * after the mnemonic:
+ *   r  a register (REG)
+ *   i  an immediate (INT or HEXINT)
+ *   l  an immediate or a label (INT, HEXINT or ID)
+ *   ,  ( )  the punctuation itself
+ *
+ * The instruction is encoded by or-ing bits with each operand in turn:
+ * register operands are shifted left by the matching entry of fields, and
+ * the immediate (fields entry immediateField) is masked to the width given
+ * by immediate. A label used as an immediate stands for its address, or
+ * for the offset to it in words if pcRelative is set.
+ */
+class Opcode {
+  public:
+    // Widths (and hence bounds) of the immediate operand
+    enum Immediate {
+      NONE,   // no immediate
+      HALF    // 16 bits: -32768..32767 in decimal, up to 0xffff in hex
+    };
+
+    static const int8_t immediateField = -1;
+
+    const char *mnemonic;
+    const char *operands;
+    uint32_t bits;
+    int8_t fields[3];
+    Immediate immediate;
+    bool pcRelative;
+
+    // Returns the number of r, i and l operands in the signature.
+    int numOperands() const;
+
+    // Returns the encoding of this instruction with the given operands,
+    // which must already be in range.
+    uint32_t encode(const int64_t *ops) const;
+};
+
+/* Returns the description of the instruction with the given mnemonic, or
+ * nullptr if there is none. This is a perfect hash lookup
+ * followed by a single comparison.
+ */
+const Opcode *findOpcode(const char *mnemonic, size_t length);
+
+#endif
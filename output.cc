@@ -0,0 +1,101 @@
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include "output.h"
+#include "scanner.h"
+
+// Throws a ScanningFailure describing the failed operation and errno
+static void outputFailure(const std::string &what) {
+  throw ScanningFailure("ERROR: Cannot write " + what + ": "
+      + strerror(errno));
+}
+
+WordWriter::WordWriter(int fd, size_t bufferSize):
+  fd(fd), buffer(bufferSize - bufferSize % 4), used(0) {}
+
+WordWriter::~WordWriter() {
+  try {
+    flush();
+  } catch (ScanningFailure &f) {
+    // Callers that care about errors flush explicitly first
+  }
+}
+
+void WordWriter::write(uint32_t word) {
+  if (used == buffer.size()) {
+    flush();
+  }
+  storeBigEndian(buffer.data() + used, word);
+  used += 4;
+}
+
+void WordWriter::write(const uint32_t *words, size_t count) {
+  while (count > 0) {
+    if (used == buffer.size()) {
+      flush();
+    }
+    size_t n = std::min(count, (buffer.size() - used) / 4);
+    unsigned char *p = buffer.data() + used;
+    for (size_t i = 0; i < n; ++i, p += 4) {
+      storeBigEndian(p, words[i]);
+    }
+    used += n * 4;
+    words += n;
+    count -= n;
+  }
+}
+
+void WordWriter::flush() {
+  const unsigned char *p = buffer.data();
+  while (used > 0) {
+    ssize_t n = ::write(fd, p, used);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      used = 0;
+      outputFailure("output");
+    }
+    p += n;
+    used -= n;
+  }
+}
+
+void writeWordsToFile(const char *path, const uint32_t *words, size_t count) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    outputFailure(path);
+  }
+
+  size_t size = count * 4;
+  if (size == 0) {
+    close(fd);
+    return;
+  }
+  if (ftruncate(fd, size) != 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    outputFailure(path);
+  }
+  void *m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED) {
+    // Some files (e.g. on special filesystems) can't be mapped
+    WordWriter writer(fd);
+    writer.write(words, count);
+    writer.flush();
+    close(fd);
+    return;
+  }
+  close(fd);
+
+  unsigned char *p = static_cast<unsigned char *>(m);
+  for (size_t i = 0; i < count; ++i, p += 4) {
+    storeBigEndian(p, words[i]);
+  }
+  munmap(m, size);
+}
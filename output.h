@@ -0,0 +1,52 @@
+#ifndef CS241_OUTPUT_H
+#define CS241_OUTPUT_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* Stores word at p as four big-endian bytes, the byte order of MIPS
+ * machine code.
+ */
+inline void storeBigEndian(unsigned char *p, uint32_t word) {
+  p[0] = word >> 24;
+  p[1] = word >> 16;
+  p[2] = word >> 8;
+  p[3] = word;
+}
+
+/* Returns the big-endian word stored in the four bytes at p.
+ */
+inline uint32_t loadBigEndian(const unsigned char *p) {
+  return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16
+    | static_cast<uint32_t>(p[2]) << 8 | p[3];
+}
+
+/* Writes machine code words to a file descriptor as big-endian bytes.
+ * Words are encoded straight into a contiguous buffer, which is written
+ * out with a single write(2) whenever it fills up and when flush is
+ * called. Throws ScanningFailure if writing fails.
+ */
+class WordWriter {
+    int fd;
+    std::vector<unsigned char> buffer;
+    size_t used;
+
+  public:
+    explicit WordWriter(int fd, size_t bufferSize = 1 << 20);
+    ~WordWriter();
+
+    WordWriter(const WordWriter &) = delete;
+    WordWriter &operator=(const WordWriter &) = delete;
+
+    void write(uint32_t word);
+    void write(const uint32_t *words, size_t count);
+    void flush();
+};
+
+/* Writes count words to the file at path (creating or truncating it) by
+ * mapping the file and encoding the words directly into the mapping.
+ * Throws ScanningFailure if the file cannot be written.
+ */
+void writeWordsToFile(const char *path, const uint32_t *words, size_t count);
+
+#endif
@@ -0,0 +1,422 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <utility>
+#include "profile.h"
+#include "scanner.h"
+
+namespace {
+
+std::string hex(uint32_t word) {
+  char text[11];
+  snprintf(text, sizeof(text), "0x%08x", word);
+  return text;
+}
+
+// Whether word is an instruction that never falls through to the next,
+// or may not: a branch or a jump
+bool endsBlock(uint32_t word) {
+  uint32_t opcode = word >> 26;
+  return opcode == 4 || opcode == 5
+    || (opcode == 0 && ((word & 0x7ff) == 8 || (word & 0x7ff) == 9));
+}
+
+bool isLis(uint32_t word) {
+  return (word & 0xfc1f07ff) == 20;
+}
+
+std::string percent(uint64_t part, uint64_t whole) {
+  char text[16];
+  snprintf(text, sizeof(text), "%.1f%%",
+    whole == 0 ? 0.0 : 100.0 * part / whole);
+  return text;
+}
+
+// Right-aligns text in width columns
+std::string pad(const std::string &text, size_t width) {
+  return text.size() >= width ? text
+    : std::string(width - text.size(), ' ') + text;
+}
+
+} // namespace
+
+std::vector<ProfileLabel> readSymbolTable(const std::string &path) {
+  std::ifstream in(path);
+  if (!in) {
+    throw ScanningFailure("ERROR: Cannot read " + path);
+  }
+  std::vector<ProfileLabel> labels;
+  std::string line;
+  int number = 0;
+  while (std::getline(in, line)) {
+    ++number;
+    std::istringstream fields(line);
+    ProfileLabel label;
+    long long address;
+    std::string rest;
+    if (!(fields >> label.name)) {
+      continue;
+    }
+    if (!(fields >> address) || (fields >> rest) || address < 0
+        || address > 0xffffffffLL) {
+      throw ScanningFailure("ERROR: Invalid symbol table " + path + " at line "
+        + std::to_string(number));
+    }
+    label.address = static_cast<uint32_t>(address);
+    labels.push_back(label);
+  }
+  std::stable_sort(labels.begin(), labels.end(),
+    [](const ProfileLabel &a, const ProfileLabel &b) {
+      return a.address < b.address
+        || (a.address == b.address && a.name < b.name);
+    });
+  return labels;
+}
+
+Profile::Profile(Machine &machine, std::vector<ProfileLabel> labels):
+  labels(std::move(labels)), executions(machine.executionCounts()),
+  transfers(machine.takenCounts()), total(0) {
+  if (executions == nullptr) {
+    throw ScanningFailure("ERROR: The machine was not profiling");
+  }
+  const uint32_t words = machine.size() / 4;
+  size_t next = 0;              // the first label after the current block
+  int label = -1;
+  bool open = false;            // whether blocks.back() may be extended
+  bool leader = true;           // whether the next instruction starts a block
+  bool data = false;            // whether the next word is a lis's data
+
+  for (uint32_t index = 0; index < words; ++index) {
+    const uint64_t count = executions[index];
+    bool labelled = false;
+    for (; next < this->labels.size()
+        && this->labels[next].address <= index * 4; ++next) {
+      // Of several labels here, the first is the block's
+      if (!labelled) {
+        label = next;
+      }
+      labelled = labelled || this->labels[next].address == index * 4;
+    }
+    if (count == 0) {
+      if (data && open) {
+        blocks.back().end = (index + 1) * 4;
+      }
+      else {
+        open = false;
+      }
+      data = false;
+      continue;
+    }
+    const uint32_t word = machine.word(index * 4);
+    if (!open || leader || labelled || count != blocks.back().runs) {
+      blocks.push_back(ProfileBlock{index * 4, index * 4, count, 0, 0, label});
+      open = true;
+    }
+    ProfileBlock &block = blocks.back();
+    block.end = (index + 1) * 4;
+    block.instructions += count;
+    block.taken += transfers[index];
+    total += count;
+    leader = endsBlock(word);
+    data = isLis(word);
+  }
+}
+
+std::string Profile::blockName(const ProfileBlock &block) const {
+  if (block.label < 0) {
+    return hex(block.start);
+  }
+  const ProfileLabel &label = labels[block.label];
+  if (label.address == block.start) {
+    return label.name;
+  }
+  char offset[16];
+  snprintf(offset, sizeof(offset), "+0x%x", block.start - label.address);
+  return label.name + offset;
+}
+
+void Profile::writeReport(std::ostream &out) const {
+  // Sum the blocks of each label, with the code before the first label
+  // last in the vector
+  std::vector<uint64_t> instructions(labels.size() + 1);
+  std::vector<uint64_t> taken(labels.size() + 1);
+  for (const ProfileBlock &block : blocks) {
+    size_t i = block.label < 0 ? labels.size() : block.label;
+    instructions[i] += block.instructions;
+    taken[i] += block.taken;
+  }
+  std::vector<size_t> order;
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    if (instructions[i] != 0) {
+      order.push_back(i);
+    }
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return instructions[a] > instructions[b];
+  });
+
+  out << "Profile of " << total << " instructions\n\n"
+    << pad("instructions", 14) << pad("%", 8) << pad("taken", 14)
+    << "  label\n";
+  for (size_t i : order) {
+    out << pad(std::to_string(instructions[i]), 14)
+      << pad(percent(instructions[i], total), 8)
+      << pad(std::to_string(taken[i]), 14) << "  "
+      << (i == labels.size() ? "(before any label)" : labels[i].name) << "\n";
+  }
+
+  const size_t hottest = 20;
+  std::vector<const ProfileBlock *> sorted;
+  for (const ProfileBlock &block : blocks) {
+    sorted.push_back(&block);
+  }
+  std::stable_sort(sorted.begin(), sorted.end(),
+    [](const ProfileBlock *a, const ProfileBlock *b) {
+      return a->instructions > b->instructions;
+    });
+  if (sorted.size() > hottest) {
+    sorted.resize(hottest);
+  }
+  out << "\nHottest blocks\n"
+    << pad("instructions", 14) << pad("%", 8) << pad("runs", 14)
+    << pad("taken", 14) << "  block\n";
+  for (const ProfileBlock *block : sorted) {
+    out << pad(std::to_string(block->instructions), 14)
+      << pad(percent(block->instructions, total), 8)
+      << pad(std::to_string(block->runs), 14)
+      << pad(std::to_string(block->taken), 14) << "  "
+      << blockName(*block) << " (" << hex(block->start) << "-"
+      << hex(block->end - 4) << ")\n";
+  }
+  out.flush();
+}
+
+void Profile::writeData(std::ostream &out) const {
+  out << "# emu profile 1\n" << "total\t" << total << "\n";
+  std::vector<uint64_t> instructions(labels.size()), taken(labels.size());
+  for (const ProfileBlock &block : blocks) {
+    if (block.label >= 0) {
+      instructions[block.label] += block.instructions;
+      taken[block.label] += block.taken;
+    }
+  }
+  for (size_t i = 0; i < labels.size(); ++i) {
+    out << "label\t" << labels[i].name << "\t" << hex(labels[i].address)
+      << "\t" << instructions[i] << "\t" << taken[i] << "\n";
+  }
+  for (const ProfileBlock &block : blocks) {
+    out << "block\t" << hex(block.start) << "\t" << hex(block.end) << "\t"
+      << block.runs << "\t" << block.instructions << "\t" << block.taken;
+    if (block.label < 0) {
+      out << "\t-\t" << hex(block.start) << "\n";
+    }
+    else {
+      out << "\t" << labels[block.label].name << "\t"
+        << hex(block.start - labels[block.label].address) << "\n";
+    }
+  }
+  for (const ProfileBlock &block : blocks) {
+    for (uint32_t index = block.start / 4; index < block.end / 4; ++index) {
+      if (executions[index] != 0) {
+        out << "pc\t" << hex(index * 4) << "\t" << executions[index] << "\t"
+          << transfers[index] << "\n";
+      }
+    }
+  }
+  out.flush();
+}
+
+CallGraph::CallGraph(uint32_t entry, uint64_t executed): counted(executed) {
+  nodes.push_back(Node{0, entry, 0, 1, 0});
+  stack.push_back(Frame{0, Machine::returnAddress});
+}
+
+void CallGraph::attribute(uint64_t executed) {
+  nodes[stack.back().node].instructions += executed - counted;
+  counted = executed;
+}
+
+void CallGraph::call(uint32_t target, uint32_t returnAddress,
+    uint64_t executed) {
+  if (stack.empty()) {
+    return;
+  }
+  attribute(executed);
+  const uint32_t parent = stack.back().node;
+  // Procedures mostly make the same call again, as in loops and recursion
+  uint32_t node = nodes[parent].last;
+  if (node == 0 || nodes[node].entry != target) {
+    const uint64_t key = static_cast<uint64_t>(parent) << 32 | target;
+    auto found = children.find(key);
+    if (found != children.end()) {
+      node = found->second;
+    }
+    else {
+      node = nodes.size();
+      nodes.push_back(Node{parent, target, 0, 0, 0});
+      children.emplace(key, node);
+    }
+    nodes[parent].last = node;
+  }
+  ++nodes[node].calls;
+  stack.push_back(Frame{node, returnAddress});
+}
+
+void CallGraph::jump(uint32_t target, uint64_t executed) {
+  if (stack.empty()) {
+    return;
+  }
+  // Returns usually go to the innermost call, so look from there
+  for (size_t frame = stack.size(); frame-- > 0;) {
+    if (stack[frame].returnAddress == target) {
+      attribute(executed);
+      stack.resize(frame);
+      return;
+    }
+  }
+}
+
+void CallGraph::finish(uint64_t executed) {
+  if (!stack.empty()) {
+    attribute(executed);
+  }
+}
+
+std::vector<std::string> CallGraph::names(
+    const std::vector<ProfileLabel> &labels) const {
+  std::unordered_map<uint32_t, std::string> named;
+  std::vector<std::string> result;
+  for (const Node &node : nodes) {
+    auto found = named.find(node.entry);
+    if (found == named.end()) {
+      // The first label at the entry or after it (labels are sorted)
+      auto label = std::lower_bound(labels.begin(), labels.end(), node.entry,
+        [](const ProfileLabel &label, uint32_t address) {
+          return label.address < address;
+        });
+      if (result.empty()) {
+        // The root runs on into the next label, unless that is a procedure
+        // of its own that it calls instead
+        const bool reached = label != labels.end()
+          && std::none_of(nodes.begin() + 1, nodes.end(),
+            [&](const Node &node) { return node.entry == label->address; });
+        result.push_back(reached ? label->name : "(root)");
+        continue;
+      }
+      found = named.emplace(node.entry,
+        label != labels.end() && label->address == node.entry
+          ? label->name : hex(node.entry)).first;
+    }
+    result.push_back(found->second);
+  }
+  return result;
+}
+
+void CallGraph::writeReport(std::ostream &out,
+    const std::vector<ProfileLabel> &labels) const {
+  const std::vector<std::string> name = names(labels);
+
+  // Number the procedures, and total each context with its descendants
+  // (which always come after it in nodes)
+  std::unordered_map<std::string, uint32_t> ids;
+  std::vector<uint32_t> id(nodes.size());
+  std::vector<std::string> procedures;
+  std::vector<uint64_t> subtree(nodes.size());
+  std::vector<std::vector<uint32_t>> children(nodes.size());
+  for (size_t node = 0; node < nodes.size(); ++node) {
+    auto found = ids.emplace(name[node], procedures.size()).first;
+    if (found->second == procedures.size()) {
+      procedures.push_back(name[node]);
+    }
+    id[node] = found->second;
+    subtree[node] = nodes[node].instructions;
+    if (node != 0) {
+      children[nodes[node].parent].push_back(node);
+    }
+  }
+  for (size_t node = nodes.size(); node-- > 1;) {
+    subtree[nodes[node].parent] += subtree[node];
+  }
+
+  // Walk the tree, counting each subtree towards its procedure's inclusive
+  // total unless the procedure is already running further up
+  std::vector<uint64_t> calls(procedures.size()), inclusive(procedures.size());
+  std::vector<uint64_t> exclusive(procedures.size());
+  std::vector<uint32_t> active(procedures.size());
+  std::vector<std::pair<uint32_t, size_t>> path{{0, 0}};
+  if (active[id[0]]++ == 0) {
+    inclusive[id[0]] += subtree[0];
+  }
+  while (!path.empty()) {
+    const uint32_t node = path.back().first;
+    if (path.back().second == 0) {
+      calls[id[node]] += nodes[node].calls;
+      exclusive[id[node]] += nodes[node].instructions;
+    }
+    if (path.back().second == children[node].size()) {
+      --active[id[node]];
+      path.pop_back();
+      continue;
+    }
+    const uint32_t child = children[node][path.back().second++];
+    if (active[id[child]]++ == 0) {
+      inclusive[id[child]] += subtree[child];
+    }
+    path.emplace_back(child, 0);
+  }
+
+  std::vector<uint32_t> order(procedures.size());
+  for (uint32_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return inclusive[a] > inclusive[b];
+  });
+  const uint64_t total = subtree[0];
+  out << "Call graph of " << total << " instructions\n\n"
+    << pad("calls", 12) << pad("inclusive", 14) << pad("%", 8)
+    << pad("exclusive", 14) << pad("%", 8) << "  procedure\n";
+  for (uint32_t i : order) {
+    out << pad(std::to_string(calls[i]), 12)
+      << pad(std::to_string(inclusive[i]), 14)
+      << pad(percent(inclusive[i], total), 8)
+      << pad(std::to_string(exclusive[i]), 14)
+      << pad(percent(exclusive[i], total), 8) << "  " << procedures[i] << "\n";
+  }
+  out.flush();
+}
+
+void CallGraph::writeFolded(std::ostream &out,
+    const std::vector<ProfileLabel> &labels) const {
+  const std::vector<std::string> name = names(labels);
+  std::vector<std::vector<uint32_t>> children(nodes.size());
+  for (size_t node = 1; node < nodes.size(); ++node) {
+    children[nodes[node].parent].push_back(node);
+  }
+
+  // Depth first, keeping the chain of names so far in stack, and on path
+  // each node with the length of stack before it and its next child
+  std::string stack = name[0];
+  struct Step {
+    uint32_t node;
+    size_t length;
+    size_t child;
+  };
+  std::vector<Step> path{{0, 0, 0}};
+  while (!path.empty()) {
+    Step &step = path.back();
+    if (step.child == 0 && nodes[step.node].instructions != 0) {
+      out << stack << " " << nodes[step.node].instructions << "\n";
+    }
+    if (step.child == children[step.node].size()) {
+      stack.resize(step.length);
+      path.pop_back();
+      continue;
+    }
+    const uint32_t child = children[step.node][step.child++];
+    path.push_back(Step{child, stack.size(), 0});
+    stack += ";" + name[child];
+  }
+  out.flush();
+}
@@ -0,0 +1,134 @@
+#ifndef CS241_PROFILE_H
+#define CS241_PROFILE_H
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "mips.h"
+
+// A label of the profiled program
+struct ProfileLabel {
+  std::string name;
+  uint32_t address;
+};
+
+// Reads a symbol table as asm prints it (a name and a decimal address on
+// each line), returning its labels sorted by address.
+std::vector<ProfileLabel> readSymbolTable(const std::string &path);
+
+/* A run of instructions that always ran together: it starts at a label, at
+ * the target of a branch or jump, or just after one, and each of its
+ * instructions ran as many times as the first (the data word of a lis
+ * belongs to the lis).
+ */
+struct ProfileBlock {
+  uint32_t start, end;          // byte addresses, end excluded
+  uint64_t runs;                // times the first instruction ran
+  uint64_t instructions;        // instructions run in the block in all
+  uint64_t taken;               // branches taken and jumps made from it
+  int label;                    // the nearest label at or before start, or -1
+};
+
+/* The flat profile of a machine that ran with profiling enabled: its
+ * instruction and taken branch counts, aggregated into blocks, each of
+ * which is attributed to the label before it. Of several labels at one
+ * address, the first alphabetically is used. The counts stay in the
+ * machine, which must outlive the profile.
+ */
+class Profile {
+    std::vector<ProfileLabel> labels;
+    std::vector<ProfileBlock> blocks;
+    const uint64_t *executions;
+    const uint64_t *transfers;
+    uint64_t total;
+
+    std::string blockName(const ProfileBlock &block) const;
+
+  public:
+    Profile(Machine &machine, std::vector<ProfileLabel> labels);
+
+    // Writes a report for people, with each label's share of the
+    // instructions and the hottest blocks, most instructions first.
+    void writeReport(std::ostream &out) const;
+
+    // Writes everything, one tab-separated record per line, with its kind
+    // first, after a "# emu profile 1" line:
+    //   total instructions
+    //   label name address instructions taken
+    //   block start end runs instructions taken label offset
+    //   pc address count taken
+    // Addresses and offsets are in hex, and label is "-" for none. Only
+    // instructions that ran have a pc record.
+    void writeData(std::ostream &out) const;
+};
+
+/* The calls a machine makes, as a tree of calling contexts, counting the
+ * instructions each runs itself, for finding the procedures (and the
+ * chains of calls to them) that take the most time.
+ *
+ * Every jalr is a call, of the procedure at its target. A jr to the
+ * address just after a call that has not returned is a return from it
+ * (and from any call made since); any other jr is a jump within the
+ * procedure. This fits the code wlp4gen generates, and the runtime's
+ * print, init, new and delete.
+ *
+ * A procedure is named by the label at its first instruction, or if there
+ * is none, by its address. The code the machine starts running is named
+ * by the first label after it instead, as wlp4gen puts wain's after its
+ * prologue, or "(root)" if there is none, or that label is a procedure
+ * something calls.
+ */
+class CallGraph {
+    struct Node {
+      uint32_t parent;          // index in nodes; the root is its own parent
+      uint32_t entry;           // address of the procedure's first instruction
+      uint64_t instructions;    // run in this context, excluding calls from it
+      uint64_t calls;           // times the context was entered
+      uint32_t last;            // the child last called from it, or 0
+    };
+    struct Frame {
+      uint32_t node;
+      uint32_t returnAddress;
+    };
+    std::vector<Node> nodes;
+    std::unordered_map<uint64_t, uint32_t> children;  // by parent and entry
+    std::vector<Frame> stack;
+    uint64_t counted;           // the count of instructions attributed so far
+
+    // Attributes the instructions run since the last call or jump
+    void attribute(uint64_t executed);
+
+    // The name of each node, by the rules above
+    std::vector<std::string> names(
+      const std::vector<ProfileLabel> &labels) const;
+
+  public:
+    // Starts with a call of the procedure at entry, returning to
+    // Machine::returnAddress, when the machine has run executed
+    // instructions.
+    explicit CallGraph(uint32_t entry, uint64_t executed = 0);
+
+    // Tells of a jalr to target returning to returnAddress, or a jr to
+    // target, once the machine has run executed instructions (including it)
+    void call(uint32_t target, uint32_t returnAddress, uint64_t executed);
+    void jump(uint32_t target, uint64_t executed);
+
+    // Attributes the last instructions when the machine has stopped
+    void finish(uint64_t executed);
+
+    // Writes a report for people: each procedure's calls, and the
+    // instructions run by it and by everything it called (counted once for
+    // recursive calls) and by it alone, the most first.
+    void writeReport(std::ostream &out,
+      const std::vector<ProfileLabel> &labels) const;
+
+    // Writes the instructions each chain of calls ran itself in the
+    // "folded stacks" format of flame graph tools: one line per chain, with
+    // the names of its procedures from the outermost, separated by ";",
+    // then a space and the count, like "wain;Ffib;Ffib 12345".
+    void writeFolded(std::ostream &out,
+      const std::vector<ProfileLabel> &labels) const;
+};
+
+#endif
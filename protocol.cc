@@ -0,0 +1,105 @@
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "protocol.h"
+#include "output.h"
+#include "scanner.h"
+
+void socketFailure(const std::string &what) {
+  throw ScanningFailure("ERROR: Cannot " + what + ": " + strerror(errno));
+}
+
+bool sendAll(int fd, const void *data, size_t size) {
+  const char *p = static_cast<const char *>(data);
+  while (size > 0) {
+    // MSG_NOSIGNAL, so that a peer hanging up is an error, not SIGPIPE
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool receiveAll(int fd, void *data, size_t size) {
+  char *p = static_cast<char *>(data);
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+sockaddr_un socketAddress(const std::string &path) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    throw ScanningFailure("ERROR: Socket path too long: " + path);
+  }
+  memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return address;
+}
+
+int connectToServer(const std::string &path) {
+  sockaddr_un address = socketAddress(path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    socketFailure("create socket");
+  }
+  if (connect(fd, reinterpret_cast<sockaddr *>(&address),
+      sizeof(address)) < 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    socketFailure("connect to " + path);
+  }
+  return fd;
+}
+
+void sendRequest(int fd, const AssemblerOptions &options, const char *source,
+    size_t size) {
+  unsigned char header[requestHeaderSize];
+  storeBigEndian(header, options.relocatable ? 1 : 0);
+  storeBigEndian(header + 4,
+    options.relaxRegister < 0 ? 0 : options.relaxRegister);
+  storeBigEndian(header + 8, size);
+  if (size > maxSourceSize || !sendAll(fd, header, sizeof(header))
+      || !sendAll(fd, source, size)) {
+    throw ScanningFailure("ERROR: Cannot send request to server");
+  }
+}
+
+void receiveResponse(int fd, ServerResponse &response) {
+  unsigned char header[responseHeaderSize];
+  if (!receiveAll(fd, header, sizeof(header))) {
+    throw ScanningFailure("ERROR: No response from server");
+  }
+  response.ok = loadBigEndian(header) == 0;
+  response.words.resize(loadBigEndian(header + 4));
+  response.text.resize(loadBigEndian(header + 8));
+
+  // The words arrive big-endian, and are converted in place
+  unsigned char *bytes =
+    reinterpret_cast<unsigned char *>(response.words.data());
+  if (!receiveAll(fd, bytes, response.words.size() * 4)
+      || !receiveAll(fd, &response.text[0], response.text.size())) {
+    throw ScanningFailure("ERROR: No response from server");
+  }
+  for (auto &word : response.words) {
+    word = loadBigEndian(reinterpret_cast<unsigned char *>(&word));
+  }
+}
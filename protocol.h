@@ -0,0 +1,59 @@
+#ifndef CS241_PROTOCOL_H
+#define CS241_PROTOCOL_H
+#include <sys/un.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "assembler.h"
+
+/* The protocol of asm --serve, spoken over a Unix domain socket. A client
+ * may send any number of requests on one connection, and each is answered
+ * in turn:
+ *
+ *   request:  flags, relax register, source length, source
+ *   response: status, word count, text length, words, text
+ *
+ * Every number (and word) is big-endian and four bytes long. Bit 0 of
+ * flags asks for a MERL object, and a relax register of 0 means branches
+ * are not relaxed. A status of 0 means the program assembled, and text is
+ * its listing; otherwise there are no words, and text holds the errors,
+ * one per line.
+ */
+struct ServerResponse {
+  bool ok;
+  std::vector<uint32_t> words;
+  std::string text;
+};
+
+// Returns a socket connected to the server at path, or throws
+// ScanningFailure.
+int connectToServer(const std::string &path);
+
+// Send a request to, and read the response from, the server on socket
+// fd, throwing ScanningFailure if the connection fails.
+void sendRequest(int fd, const AssemblerOptions &options, const char *source,
+  size_t size);
+void receiveResponse(int fd, ServerResponse &response);
+
+// Shared by the client and the server
+
+const size_t requestHeaderSize = 12;
+const size_t responseHeaderSize = 12;
+
+// Requests for bigger programs than this are refused, by closing the
+// connection, rather than trusting a corrupt length
+const uint32_t maxSourceSize = 1u << 30;
+
+// Throws a ScanningFailure describing the failed operation and errno
+void socketFailure(const std::string &what);
+
+// Writes all size bytes, returning false if the connection fails
+bool sendAll(int fd, const void *data, size_t size);
+
+// Reads exactly size bytes, returning false on end of file or an error
+bool receiveAll(int fd, void *data, size_t size);
+
+sockaddr_un socketAddress(const std::string &path);
+
+#endif
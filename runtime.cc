@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+#include <string>
+#include "runtime.h"
+#include "scanner.h"
+
+namespace {
+
+std::string hex(uint32_t word) {
+  char text[11];
+  snprintf(text, sizeof(text), "0x%08x", word);
+  return text;
+}
+
+} // namespace
+
+NativeRuntime::NativeRuntime(uint32_t heapStart, uint32_t heapEnd):
+  heapStart((heapStart + 3) & ~3u), heapEnd(heapEnd & ~3u), top(0),
+  lists(listedWords) {
+  if (this->heapEnd < this->heapStart) {
+    this->heapEnd = this->heapStart;
+  }
+  sizes.resize((this->heapEnd - this->heapStart) / 4);
+  // A program that never calls init still gets a heap
+  reset();
+}
+
+void NativeRuntime::install(Machine &machine,
+    const std::vector<ProfileLabel> &labels) {
+  typedef void (NativeRuntime::*Procedure)(Machine &);
+  const struct {
+    const char *name;
+    Procedure procedure;
+  } procedures[] = {
+    {"init", &NativeRuntime::init},
+    {"new", &NativeRuntime::allocate},
+    {"delete", &NativeRuntime::free},
+    {"print", &NativeRuntime::print},
+  };
+  std::vector<uint32_t> addresses;
+  for (auto &p : procedures) {
+    auto label = std::find_if(labels.begin(), labels.end(),
+      [&](const ProfileLabel &label) { return label.name == p.name; });
+    if (label == labels.end()) {
+      throw ScanningFailure(std::string("ERROR: The symbol table has no ")
+        + p.name + ", so the program does not use the WLP4 runtime");
+    }
+    addresses.push_back(label->address);
+  }
+  for (size_t i = 0; i < addresses.size(); ++i) {
+    Procedure procedure = procedures[i].procedure;
+    machine.hook(addresses[i], [this, procedure](Machine &m) {
+      (this->*procedure)(m);
+    });
+  }
+}
+
+void NativeRuntime::reset() {
+  top = heapStart;
+  std::fill(sizes.begin(), sizes.end(), 0);
+  for (auto &list : lists) {
+    list.clear();
+  }
+  freeBlocks.clear();
+  bySize.clear();
+}
+
+void NativeRuntime::release(uint32_t address, uint32_t words) {
+  auto next = freeBlocks.lower_bound(address);
+  if (next != freeBlocks.end() && address + 4 * words == next->first) {
+    words += next->second;
+    bySize.erase({next->second, next->first});
+    next = freeBlocks.erase(next);
+  }
+  if (next != freeBlocks.begin()) {
+    auto previous = std::prev(next);
+    if (previous->first + 4 * previous->second == address) {
+      bySize.erase({previous->second, previous->first});
+      address = previous->first;
+      words += previous->second;
+      freeBlocks.erase(previous);
+    }
+  }
+  // A block at the top just lowers it
+  if (address + 4 * words == top) {
+    top = address;
+    return;
+  }
+  freeBlocks[address] = words;
+  bySize.insert({words, address});
+}
+
+bool NativeRuntime::reserve(uint32_t words, uint32_t &address) {
+  auto best = bySize.lower_bound({words, 0});
+  if (best != bySize.end()) {
+    const uint32_t found = best->first;
+    address = best->second;
+    bySize.erase(best);
+    freeBlocks.erase(address);
+    if (found > words) {
+      freeBlocks[address + 4 * words] = found - words;
+      bySize.insert({found - words, address + 4 * words});
+    }
+    return true;
+  }
+  if (words <= (heapEnd - top) / 4) {
+    address = top;
+    top += 4 * words;
+    return true;
+  }
+  return false;
+}
+
+bool NativeRuntime::mergeLists() {
+  bool merged = false;
+  for (uint32_t words = 1; words < listedWords; ++words) {
+    for (uint32_t address : lists[words]) {
+      release(address, words);
+      merged = true;
+    }
+    lists[words].clear();
+  }
+  return merged;
+}
+
+void NativeRuntime::init(Machine &) {
+  reset();
+}
+
+void NativeRuntime::allocate(Machine &machine) {
+  const int32_t requested = static_cast<int32_t>(machine.reg(1));
+  machine.reg(3) = 0;
+  if (requested < 0) {
+    return;
+  }
+  // Every allocation gets its own address, even of no words
+  const uint32_t words = requested == 0 ? 1 : requested;
+  uint32_t address;
+  if (words < listedWords && !lists[words].empty()) {
+    address = lists[words].back();
+    lists[words].pop_back();
+  }
+  else if (!reserve(words, address)
+      && !(mergeLists() && reserve(words, address))) {
+    return;
+  }
+  sizes[(address - heapStart) / 4] = words;
+  machine.reg(3) = address;
+}
+
+void NativeRuntime::free(Machine &machine) {
+  const uint32_t address = machine.reg(1);
+  const uint32_t index = (address - heapStart) / 4;
+  if (address < heapStart || address >= heapEnd || address % 4 != 0
+      || sizes[index] == 0) {
+    throw ScanningFailure("ERROR: delete of " + hex(address)
+      + ", which new did not return");
+  }
+  const uint32_t words = sizes[index];
+  sizes[index] = 0;
+  if (words < listedWords) {
+    lists[words].push_back(address);
+  }
+  else {
+    release(address, words);
+  }
+}
+
+void NativeRuntime::print(Machine &machine) {
+  const int32_t value = static_cast<int32_t>(machine.reg(1));
+  uint32_t magnitude = value < 0 ? 0u - static_cast<uint32_t>(value) : value;
+  char digits[10];
+  int length = 0;
+  do {
+    digits[length++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (value < 0) {
+    putchar_unlocked('-');
+  }
+  while (length > 0) {
+    putchar_unlocked(digits[--length]);
+  }
+  putchar_unlocked('\n');
+}
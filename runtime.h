@@ -0,0 +1,63 @@
+#ifndef CS241_RUNTIME_H
+#define CS241_RUNTIME_H
+#include <cstdint>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+#include "mips.h"
+#include "profile.h"
+
+/* The WLP4 runtime's procedures, run on the host in place of their MIPS
+ * code, which takes thousands of instructions for a call of new or print.
+ * Each is called as wlp4gen's code calls it, and returns as it would:
+ *   init: starts a new heap ($1 and $2 are ignored);
+ *   new: allocates $1 words and puts their address in $3, or 0 if there is
+ *     no room (or $1 is negative);
+ *   delete: frees what new allocated at $1;
+ *   print: writes $1 in decimal, as a signed integer, and a newline.
+ * Only $3 (for new) changes. The heap is a range of the machine's memory,
+ * which the program (and its stack) must leave alone. Freed blocks of a
+ * few words are kept on a list for their size and reused first; larger
+ * ones go into a free map, where neighbours are merged. Otherwise the best
+ * fit in the map is used, or else the unused top of the heap, and only
+ * when neither has room are the lists merged into the map.
+ */
+class NativeRuntime {
+    static const uint32_t listedWords = 32;     // sizes kept on lists
+
+    uint32_t heapStart, heapEnd;                // byte addresses, end excluded
+    uint32_t top;                               // the end of the heap used
+    std::vector<uint32_t> sizes;                // words allocated at each word
+    std::vector<std::vector<uint32_t>> lists;   // freed addresses by words
+    std::map<uint32_t, uint32_t> freeBlocks;    // other free words by address
+    std::set<std::pair<uint32_t, uint32_t>> bySize;   // (words, address)
+
+    // Makes the whole heap free
+    void reset();
+    // Adds a block to the free map, merged with its free neighbours
+    void release(uint32_t address, uint32_t words);
+    // Finds room for words in the map or at the top, if there is any
+    bool reserve(uint32_t words, uint32_t &address);
+    // Moves the blocks on the lists into the map, returning whether any were
+    bool mergeLists();
+
+  public:
+    NativeRuntime(uint32_t heapStart, uint32_t heapEnd);
+
+    NativeRuntime(const NativeRuntime &) = delete;
+    NativeRuntime &operator=(const NativeRuntime &) = delete;
+
+    // Hooks (see Machine::hook) the procedures above into machine, which
+    // must not outlive the runtime, at their labels in labels. All four
+    // must be there, or none is hooked and it fails: a program with only
+    // some has procedures of its own by those names.
+    void install(Machine &machine, const std::vector<ProfileLabel> &labels);
+
+    void init(Machine &machine);
+    void allocate(Machine &machine);
+    void free(Machine &machine);
+    void print(Machine &machine);
+};
+
+#endif
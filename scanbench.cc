@@ -0,0 +1,98 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include "scanner.h"
+#include "input.h"
+using namespace std;
+
+/*
+ * Microbenchmark for the scanner's whitespace and comment fast paths.
+ *
+ * Usage: scanbench [file.asm]
+ *
+ * Scans the given file (or, without one, a synthetic program shaped like
+ * wlp4gen output) repeatedly with the fast paths disabled and then enabled,
+ * and reports the throughput of each in bytes per second.
+ */
+
+// Builds roughly size bytes of indented, commented assembly.
+string syntheticProgram(size_t size) {
+  const char *lines[] = {
+    "        sw $3, 0($30)           ; push ($3)\n",
+    "        sub $30, $30, $4\n",
+    "        lw $5, 4($30)           ; pop ($5)\n",
+    "        add $30, $30, $4\n",
+    "        lis $3\n",
+    "        .word 241\n",
+    "; ------------------------------------------------------------------\n",
+    "loop12:\n",
+    "        beq $3, $0, done12      ; if test fails\n",
+  };
+  string program;
+  for (size_t i = 0; program.size() < size; ++i) {
+    program += lines[i % (sizeof(lines) / sizeof(lines[0]))];
+  }
+  return program;
+}
+
+// Returns the scanning throughput in bytes per second for input.
+double measure(const char *input, size_t size) {
+  vector<TokenView> tokens;
+  size_t bytes = 0;
+  auto start = chrono::steady_clock::now();
+  chrono::duration<double> elapsed;
+
+  do {
+    tokens.clear();
+    scanProgram(input, size, tokens);
+    bytes += size;
+    elapsed = chrono::steady_clock::now() - start;
+  } while (elapsed.count() < 1.0);
+
+  return bytes / elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  string synthetic;
+  unique_ptr<InputBuffer> file;
+  const char *input;
+  size_t size;
+
+  try {
+    if (argc > 1) {
+      int fd = open(argv[1], O_RDONLY);
+      if (fd < 0) {
+        cerr << "ERROR: Cannot open " << argv[1] << endl;
+        return 1;
+      }
+      file.reset(new InputBuffer(fd));
+      close(fd);
+      input = file->data();
+      size = file->size();
+    } else {
+      synthetic = syntheticProgram(16 << 20);
+      input = synthetic.data();
+      size = synthetic.size();
+    }
+
+    setScanSkipping(false);
+    double before = measure(input, size);
+    setScanSkipping(true);
+    double after = measure(input, size);
+
+    cout << fixed << setprecision(1);
+    cout << "input:         " << size << " bytes" << endl;
+    cout << "DFA only:      " << before / 1e6 << " MB/s" << endl;
+    cout << "with skipping: " << after / 1e6 << " MB/s" << endl;
+    cout << "speedup:       " << after / before << "x" << endl;
+  } catch (ScanningFailure &f) {
+    cerr << f.what() << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -1,11 +1,11 @@
-#include <sstream>
-#include <iomanip>
-#include <cctype>
 #include <algorithm>
 #include <utility>
-#include <set>
-#include <array>
+#include <cstring>
 #include "scanner.h"
+#include "symbols.h"
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 /*
  * C++ Starter code for CS241 A3
@@ -17,8 +17,40 @@
  * the DFA assignments, you do not need to understand it to write the assembler.
  */
 
+/* Numeric values are accumulated with saturation at valueCap, which is
+ * larger than any valid constant, so that long runs of digits can't
+ * overflow but are still detected as out of range.
+ */
+static const int64_t valueCap = int64_t(1) << 36;
+
 Token::Token(Token::Kind kind, std::string lexeme):
-  kind(kind), lexeme(std::move(lexeme)) {}
+  kind(kind), lexeme(std::move(lexeme)), value(0) {
+  size_t start = 0;
+  int64_t radix = 10;
+
+  if (kind == INT) {
+    start = this->lexeme[0] == '-' ? 1 : 0;
+  } else if (kind == HEXINT) {
+    start = 2;
+    radix = 16;
+  } else if (kind == REG) {
+    start = 1;
+  } else {
+    return;
+  }
+
+  for (size_t i = start; i < this->lexeme.size(); ++i) {
+    char c = this->lexeme[i];
+    int digit = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+    value = std::min(value * radix + digit, valueCap);
+  }
+  if (start == 1 && kind == INT) {
+    value = -value;
+  }
+}
+
+Token::Token(Token::Kind kind, std::string lexeme, int64_t value):
+  kind(kind), lexeme(std::move(lexeme)), value(value) {}
 
   Token:: Kind Token::getKind() const { return kind; }
 const std::string &Token::getLexeme() const { return lexeme; }
@@ -29,38 +61,31 @@ std::ostream &operator<<(std::ostream &out, const Token &tok) {
     case Token::ID:         out << "ID";         break;
     case Token::LABEL:      out << "LABEL";      break;
     case Token::WORD:       out << "WORD";       break;
+    case Token::IMPORT:     out << "IMPORT";     break;
+    case Token::EXPORT:     out << "EXPORT";     break;
+    case Token::SPACE:      out << "SPACE";      break;
+    case Token::FILL:       out << "FILL";       break;
+    case Token::INCBIN:     out << "INCBIN";     break;
     case Token::COMMA:      out << "COMMA";      break;
     case Token::LPAREN:     out << "LPAREN";     break;
     case Token::RPAREN:     out << "RPAREN";     break;
     case Token::INT:        out << "INT";        break;
     case Token::HEXINT:     out << "HEXINT";     break;
     case Token::REG:        out << "REG";        break;
+    case Token::STRING:     out << "STRING";     break;
     case Token::WHITESPACE: out << "WHITESPACE"; break;
     case Token::COMMENT:    out << "COMMENT";    break;
+    case Token::NEWLINE:    out << "NEWLINE";    break;
   }
   out << ", " << tok.getLexeme() << ")";
 
   return out;
 }
 
-int64_t Token::toLong() const {
-  std::istringstream iss;
-  int64_t result;
-
-  if (kind == INT) {
-    iss.str(lexeme);
-  } else if (kind == HEXINT) {
-    iss.str(lexeme.substr(2));
-    iss >> std::hex;
-  } else if (kind == REG) {
-    iss.str(lexeme.substr(1));
-  } else {
-    // This should never happen if the user calls this function correctly
-    return 0;
-  }
+int64_t Token::toLong() const { return value; }
 
-  iss >> result;
-  return result;
+Token TokenView::toToken(const char *input) const {
+  return Token(kind, std::string(input + offset, length), value);
 }
 
 ScanningFailure::ScanningFailure(std::string message):
@@ -68,6 +93,138 @@ ScanningFailure::ScanningFailure(std::string message):
 
 const std::string &ScanningFailure::what() const { return message; }
 
+/* Fast paths for the two kinds of token that make up most of the bytes in
+ * a typical program: runs of whitespace and comments. Once the DFA has
+ * entered WHITESPACE or COMMENT, the rest of the token can be found without
+ * stepping the DFA one byte at a time. Each function returns the first
+ * position in [p, end) that the corresponding DFA state would fail on,
+ * which is where the token ends, or end if there is none.
+ *
+ * Whitespace is ' ' and '\t' through '\r'. A comment runs up to the next
+ * '\n' or non-ASCII byte (both have no transition out of COMMENT).
+ *
+ * Bytes in [end, limit) may be read but never decide the result; scanning
+ * a line of a larger buffer passes the end of the buffer as the limit, so
+ * that short lines can still be examined a whole vector at a time.
+ */
+static bool scanSkipping = true;
+
+void setScanSkipping(bool enabled) { scanSkipping = enabled; }
+
+typedef const char *(*SkipFunction)(const char *p, const char *end,
+    const char *limit);
+
+static const char *skipWhitespaceScalar(const char *p, const char *end,
+    const char *) {
+  while (p != end && (*p == ' ' || (*p >= '\t' && *p <= '\r'))) {
+    ++p;
+  }
+  return p;
+}
+
+static const char *skipCommentScalar(const char *p, const char *end,
+    const char *) {
+  while (p != end && *p != '\n' && static_cast<signed char>(*p) >= 0) {
+    ++p;
+  }
+  return p;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// Returns the position of the first set bit of stop within the vector of
+// width bytes at p, clamped to end, or nullptr to keep going.
+static inline const char *firstStop(const char *p, unsigned stop,
+    int width, const char *end) {
+  if (stop != 0) {
+    p += __builtin_ctz(stop);
+    return p < end ? p : end;
+  }
+  return p + width >= end ? end : nullptr;
+}
+
+static const char *skipWhitespaceSSE2(const char *p, const char *end,
+    const char *limit) {
+  for (; limit - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    // c - '\t' <= '\r' - '\t' (unsigned) is the same as the saturating
+    // subtraction below being zero.
+    __m128i control = _mm_subs_epu8(_mm_sub_epi8(chunk, _mm_set1_epi8('\t')),
+        _mm_set1_epi8('\r' - '\t'));
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+        _mm_cmpeq_epi8(control, _mm_setzero_si128()));
+    const char *stop = firstStop(p, ~_mm_movemask_epi8(ws) & 0xffff, 16, end);
+    if (stop != nullptr) {
+      return stop;
+    }
+  }
+  return skipWhitespaceScalar(p, end, limit);
+}
+
+static const char *skipCommentSSE2(const char *p, const char *end,
+    const char *limit) {
+  for (; limit - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    // The sign bit of each byte is already set for non-ASCII bytes.
+    __m128i stops = _mm_or_si128(chunk,
+        _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+    const char *stop = firstStop(p, _mm_movemask_epi8(stops), 16, end);
+    if (stop != nullptr) {
+      return stop;
+    }
+  }
+  return skipCommentScalar(p, end, limit);
+}
+
+__attribute__((target("avx2")))
+static const char *skipWhitespaceAVX2(const char *p, const char *end,
+    const char *limit) {
+  for (; limit - p >= 32; p += 32) {
+    __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    __m256i control = _mm256_subs_epu8(
+        _mm256_sub_epi8(chunk, _mm256_set1_epi8('\t')),
+        _mm256_set1_epi8('\r' - '\t'));
+    __m256i ws = _mm256_or_si256(
+        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' ')),
+        _mm256_cmpeq_epi8(control, _mm256_setzero_si256()));
+    const char *stop = firstStop(p, ~_mm256_movemask_epi8(ws), 32, end);
+    if (stop != nullptr) {
+      return stop;
+    }
+  }
+  return skipWhitespaceSSE2(p, end, limit);
+}
+
+__attribute__((target("avx2")))
+static const char *skipCommentAVX2(const char *p, const char *end,
+    const char *limit) {
+  for (; limit - p >= 32; p += 32) {
+    __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    __m256i stops = _mm256_or_si256(chunk,
+        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n')));
+    const char *stop = firstStop(p, _mm256_movemask_epi8(stops), 32, end);
+    if (stop != nullptr) {
+      return stop;
+    }
+  }
+  return skipCommentSSE2(p, end, limit);
+}
+
+// This runs during static initialization, before the CPU model is
+// guaranteed to have been set up, hence the explicit __builtin_cpu_init.
+static bool hasAVX2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+static const SkipFunction skipWhitespace =
+    hasAVX2() ? skipWhitespaceAVX2 : skipWhitespaceSSE2;
+static const SkipFunction skipComment =
+    hasAVX2() ? skipCommentAVX2 : skipCommentSSE2;
+#else
+static const SkipFunction skipWhitespace = skipWhitespaceScalar;
+static const SkipFunction skipComment = skipCommentScalar;
+#endif
+
 /* Represents a DFA (which you will see formally in class later)
  * to handle the scanning
  * process. You should not need to interact with this directly:
@@ -87,6 +244,7 @@ class AsmDFA {
       REG,
       WHITESPACE,
       COMMENT,
+      STRING,
 
       // States that are not also kinds
       FAIL,
@@ -97,153 +255,308 @@ class AsmDFA {
       ZEROX,
       MINUS,
       DOLLARS,
+      QUOTE,
 
       // Hack to let this be used easily in arrays. This should always be the
       // final element in the enum, and should always point to the previous
       // element.
 
-      LARGEST_STATE = DOLLARS
+      LARGEST_STATE = QUOTE
     };
 
   private:
-    /* A set of all accepting states for the DFA.
-     * Currently non-accepting states are not actually present anywhere
-     * in memory, but a list can be found in the constructor.
+    /* Character classes used by the transition function. These are
+     * constexpr stand-ins for the <cctype> functions (in the "C" locale),
+     * so that the whole table can be built at compile time.
      */
-    std::set<State> acceptingStates;
+    static constexpr bool isAlpha(int c) {
+      return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+    static constexpr bool isDigit(int c) { return c >= '0' && c <= '9'; }
+    static constexpr bool isAlnum(int c) { return isAlpha(c) || isDigit(c); }
+    static constexpr bool isXDigit(int c) {
+      return isDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    }
+    static constexpr bool isSpace(int c) {
+      return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+    static constexpr bool notNewline(int c) { return c != '\n'; }
+    static constexpr bool inString(int c) { return c != '\n' && c != '"'; }
 
-    /*
-     * The transition function for the DFA, stored as a map.
+    /* The transition function for the DFA, indexed by state and then by
+     * the input byte. Bytes outside of ASCII always fail. States are stored
+     * as single bytes to keep the whole table within a few cache lines per
+     * state.
      */
+    struct TransitionTable {
+      uint8_t next[LARGEST_STATE + 1][256];
+    };
+    static const TransitionTable transitionFunction;
 
-    std::array<std::array<State, 128>, LARGEST_STATE + 1> transitionFunction;
+    /* A bitmask of all accepting states for the DFA, with bit s set when
+     * state s accepts. Non-accepting states are DOT, MINUS, ZEROX, DOLLARS,
+     * QUOTE, START and FAIL.
+     */
+    static constexpr uint32_t acceptingStates =
+        1u << ID | 1u << LABEL | 1u << DOTID | 1u << HEXINT |
+        1u << INT | 1u << ZERO | 1u << COMMA | 1u << REG |
+        1u << LPAREN | 1u << RPAREN | 1u << WHITESPACE | 1u << COMMENT |
+        1u << STRING;
+
+    /* The kind of token produced by each accepting state. Entries for
+     * non-accepting states are never read.
+     */
+    struct KindTable {
+      Token::Kind kind[LARGEST_STATE + 1];
+    };
+    static const KindTable stateKinds;
+
+    /* The radix of the number being read in each state, and the value of
+     * each digit. While munching, every transition into state s on c
+     * updates the token's value to value * radix[s] + digit[c], which
+     * accumulates INT, HEXINT and REG values as their digits are read and
+     * leaves them unaffected by the leading "-", "0x" or "$". Other states
+     * have radix 0, so their values are meaningless but harmless.
+     */
+    struct DigitTables {
+      int64_t radix[LARGEST_STATE + 1];
+      int64_t digit[256];
+    };
+    static const DigitTables digitTables;
 
     /*
      * Converts a state to a kind to allow construction of Tokens from States.
      * Throws an exception if conversion is not possible.
      */
     Token::Kind stateToKind(State s) const {
-      switch(s) {
-        case ID:         return Token::ID;
-        case LABEL:      return Token::LABEL;
-        case DOTID:      return Token::WORD;
-        case COMMA:      return Token::COMMA;
-        case LPAREN:     return Token::LPAREN;
-        case RPAREN:     return Token::RPAREN;
-        case INT:        return Token::INT;
-        case ZERO:       return Token::INT;
-        case HEXINT:     return Token::HEXINT;
-        case REG:        return Token::REG;
-        case WHITESPACE: return Token::WHITESPACE;
-        case COMMENT:    return Token::COMMENT;
-        default: throw ScanningFailure("ERROR: Cannot convert state to kind.");
+      if (!accept(s)) {
+        throw ScanningFailure("ERROR: Cannot convert state to kind.");
       }
+      return stateKinds.kind[s];
     }
 
-
   public:
-    /* Tokenizes an input string according to the SMM algorithm.
-     * You will learn the SMM algorithm in class around the time of Assignment 6.
+    /* Returns the kind of the directive whose lexeme is the length bytes
+     * at begin, throwing if there is no such directive.
      */
-    std::vector<Token> simplifiedMaximalMunch(const std::string &input) const {
-      std::vector<Token> result;
+    static Token::Kind directiveKind(const char *begin, size_t length) {
+      static const struct {
+        const char *name;
+        Token::Kind kind;
+      } directives[] = {
+        {".word", Token::WORD},
+        {".import", Token::IMPORT},
+        {".export", Token::EXPORT},
+        {".space", Token::SPACE},
+        {".fill", Token::FILL},
+        {".incbin", Token::INCBIN},
+      };
+
+      for (auto &directive : directives) {
+        if (strlen(directive.name) == length
+            && memcmp(begin, directive.name, length) == 0) {
+          return directive.kind;
+        }
+      }
+      throw ScanningFailure("ERROR: DOTID token unrecognized: " +
+          std::string(begin, length));
+    }
 
+    /* Tokenizes the input range [begin, end), which is line number line of
+     * the buffer starting at base, according to the SMM algorithm. Views of
+     * the tokens (relative to base) are appended to result. The buffer must
+     * be readable up to limit. You will learn the SMM algorithm in class
+     * around the time of Assignment 6.
+     *
+     * Tokens are filtered as they are produced, so that nothing has to be
+     * copied into a second list afterwards:
+     * * Throw exceptions for WORD tokens whose lexemes aren't directives,
+     *   and give each directive other than ".word" its own kind.
+     * * Drop WHITESPACE and COMMENT tokens entirely.
+     */
+    void simplifiedMaximalMunch(const char *base, const char *begin,
+        const char *end, const char *limit, uint32_t line,
+        std::vector<TokenView> &result) const {
       State state = start();
-      std::string munchedInput;
+      const char *tokenStart = begin;
+      int64_t value = 0;
 
       // We can't use a range-based for loop effectively here
       // since the iterator doesn't always increment.
-      for (std::string::const_iterator inputPosn = input.begin();
-           inputPosn != input.end();) {
+      for (const char *inputPosn = begin; inputPosn != end;) {
 
         State oldState = state;
         state = transition(state, *inputPosn);
 
         if (!failed(state)) {
-          munchedInput += *inputPosn;
           oldState = state;
+          value = std::min(value * digitTables.radix[state]
+              + digitTables.digit[static_cast<unsigned char>(*inputPosn)],
+              valueCap);
 
           ++inputPosn;
+
+          // Jump to the end of whitespace and comments rather than stepping
+          // through them; the next transition then fails as usual.
+          if (scanSkipping) {
+            if (state == WHITESPACE) {
+              inputPosn = skipWhitespace(inputPosn, end, limit);
+            } else if (state == COMMENT) {
+              inputPosn = skipComment(inputPosn, end, limit);
+            }
+          }
         }
 
-        if (inputPosn == input.end() || failed(state)) {
+        if (inputPosn == end || failed(state)) {
           if (accept(oldState)) {
-            result.push_back(Token(stateToKind(oldState), munchedInput));
+            Token::Kind kind = stateToKind(oldState);
+            size_t length = inputPosn - tokenStart;
+
+            if (kind == Token::WORD) {
+              kind = directiveKind(tokenStart, length);
+            }
+            if (kind != Token::WHITESPACE && kind != Token::COMMENT) {
+              result.push_back(TokenView{kind, line,
+                  static_cast<uint32_t>(tokenStart - begin + 1),
+                  Symbols::noSymbol, static_cast<size_t>(tokenStart - base),
+                  length, tokenValue(kind, tokenStart, value)});
+            }
 
-            munchedInput = "";
+            tokenStart = inputPosn;
+            value = 0;
             state = start();
           } else {
-            if (failed(state)) {
-              munchedInput += *inputPosn;
-            }
+            const char *munchedEnd = failed(state) ? inputPosn + 1 : inputPosn;
             throw ScanningFailure("ERROR: Simplified maximal munch failed on input: "
-                                 + munchedInput);
+                                 + std::string(tokenStart, munchedEnd));
           }
         }
       }
+    }
+
+    /* Builds the transition function for the DFA. This only ever runs
+     * at compile time, to initialize transitionFunction.
+     */
+    static constexpr TransitionTable buildTransitionFunction() {
+      TransitionTable table{};
+
+      for (int s = 0; s <= LARGEST_STATE; ++s) {
+        for (int c = 0; c < 256; ++c) {
+          table.next[s][c] = FAIL;
+        }
+      }
+
+      registerTransition(table, START, isAlpha, ID);
+      registerTransition(table, START, ".", DOT);
+      registerTransition(table, START, "0", ZERO);
+      registerTransition(table, START, "123456789", INT);
+      registerTransition(table, START, "-", MINUS);
+      registerTransition(table, START, ";", COMMENT);
+      registerTransition(table, START, isSpace, WHITESPACE);
+      registerTransition(table, START, "$", DOLLARS);
+      registerTransition(table, START, ",", COMMA);
+      registerTransition(table, START, "(", LPAREN);
+      registerTransition(table, START, ")", RPAREN);
+      registerTransition(table, START, "\"", QUOTE);
+      registerTransition(table, ID, isAlnum, ID);
+      registerTransition(table, ID, ":", LABEL);
+      registerTransition(table, DOT, isAlpha, DOTID);
+      registerTransition(table, DOTID, isAlpha, DOTID);
+      registerTransition(table, ZERO, "x", ZEROX);
+      registerTransition(table, ZERO, isDigit, INT);
+      registerTransition(table, ZEROX, isXDigit, HEXINT);
+      registerTransition(table, HEXINT, isXDigit, HEXINT);
+      registerTransition(table, MINUS, isDigit, INT);
+      registerTransition(table, INT, isDigit, INT);
+      registerTransition(table, COMMENT, notNewline, COMMENT);
+      registerTransition(table, WHITESPACE, isSpace, WHITESPACE);
+      registerTransition(table, DOLLARS, isDigit, REG);
+      registerTransition(table, REG, isDigit, REG);
+      registerTransition(table, QUOTE, inString, QUOTE);
+      registerTransition(table, QUOTE, "\"", STRING);
+
+      return table;
+    }
+
+    /* Builds the state to kind table used by stateToKind.
+     */
+    static constexpr KindTable buildStateKinds() {
+      KindTable table{};
+
+      table.kind[ID]         = Token::ID;
+      table.kind[LABEL]      = Token::LABEL;
+      table.kind[DOTID]      = Token::WORD;
+      table.kind[COMMA]      = Token::COMMA;
+      table.kind[LPAREN]     = Token::LPAREN;
+      table.kind[RPAREN]     = Token::RPAREN;
+      table.kind[INT]        = Token::INT;
+      table.kind[ZERO]       = Token::INT;
+      table.kind[HEXINT]     = Token::HEXINT;
+      table.kind[REG]        = Token::REG;
+      table.kind[WHITESPACE] = Token::WHITESPACE;
+      table.kind[COMMENT]    = Token::COMMENT;
+      table.kind[STRING]     = Token::STRING;
+
+      return table;
+    }
+
+    /* Builds the radix and digit tables used to accumulate values.
+     */
+    static constexpr DigitTables buildDigitTables() {
+      DigitTables tables{};
+
+      tables.radix[ZERO] = 10;
+      tables.radix[INT] = 10;
+      tables.radix[HEXINT] = 16;
+      tables.radix[REG] = 10;
+
+      for (int c = 0; c < 256; ++c) {
+        tables.digit[c] = isDigit(c) ? c - '0'
+          : isXDigit(c) ? (c | 0x20) - 'a' + 10 : 0;
+      }
 
-      return result;
+      return tables;
     }
 
-    /* Initializes the accepting states for the DFA.
+    /* Returns the value of a token of the given kind whose digits were
+     * accumulated as magnitude, or throws if it is out of range.
      */
-    AsmDFA() {
-      acceptingStates = {ID, LABEL, DOTID, HEXINT,
-                           INT, ZERO, COMMA, REG,
-                           LPAREN, RPAREN, WHITESPACE, COMMENT};
-      //Non-accepting states are DOT, MINUS, ZEROX, DOLLARS, START
-
-      // Initialize transitions for the DFA
-      for (size_t i = 0; i < transitionFunction.size(); ++i) {
-        for (size_t j = 0; j < transitionFunction[0].size(); ++j) {
-          transitionFunction[i][j] = FAIL;
+    static int64_t tokenValue(Token::Kind kind, const char *lexeme,
+        int64_t magnitude) {
+      int64_t value = magnitude;
+      bool inRange = true;
+
+      if (kind == Token::INT) {
+        if (*lexeme == '-') {
+          value = -value;
         }
+        inRange = value >= INT32_MIN && value <= UINT32_MAX;
+      } else if (kind == Token::HEXINT) {
+        inRange = value <= UINT32_MAX;
+      } else if (kind == Token::REG) {
+        inRange = value <= 31;
       }
 
-      registerTransition(START, isalpha, ID);
-      registerTransition(START, ".", DOT);
-      registerTransition(START, "0", ZERO);
-      registerTransition(START, "123456789", INT);
-      registerTransition(START, "-", MINUS);
-      registerTransition(START, ";", COMMENT);
-      registerTransition(START, isspace, WHITESPACE);
-      registerTransition(START, "$", DOLLARS);
-      registerTransition(START, ",", COMMA);
-      registerTransition(START, "(", LPAREN);
-      registerTransition(START, ")", RPAREN);
-      registerTransition(ID, isalnum, ID);
-      registerTransition(ID, ":", LABEL);
-      registerTransition(DOT, isalpha, DOTID);
-      registerTransition(DOTID, isalpha, DOTID);
-      registerTransition(ZERO, "x", ZEROX);
-      registerTransition(ZERO, isdigit, INT);
-      registerTransition(ZEROX, isxdigit, HEXINT);
-      registerTransition(HEXINT, isxdigit, HEXINT);
-      registerTransition(MINUS, isdigit, INT);
-      registerTransition(INT, isdigit, INT);
-      registerTransition(COMMENT, [](int c) -> int { return c != '\n'; },
-          COMMENT);
-      registerTransition(WHITESPACE, isspace, WHITESPACE);
-      registerTransition(DOLLARS, isdigit, REG);
-      registerTransition(REG, isdigit, REG);
+      if (!inRange) {
+        throw ScanningFailure("ERROR: Constant out of bound.");
+      }
+      return value;
     }
 
     // Register a transition on all chars in chars
-    void registerTransition(State oldState, const std::string &chars,
-        State newState) {
-      for (char c : chars) {
-        transitionFunction[oldState][c] = newState;
+    static constexpr void registerTransition(TransitionTable &table,
+        State oldState, const char *chars, State newState) {
+      for (; *chars != '\0'; ++chars) {
+        table.next[oldState][static_cast<unsigned char>(*chars)] = newState;
       }
     }
 
-    // Register a transition on all chars matching test
-    // For some reason the cctype functions all use ints, hence the function
-    // argument type.
-    void registerTransition(State oldState, int (*test)(int), State newState) {
-
+    // Register a transition on all (ASCII) chars matching test
+    static constexpr void registerTransition(TransitionTable &table,
+        State oldState, bool (*test)(int), State newState) {
       for (int c = 0; c < 128; ++c) {
         if (test(c)) {
-          transitionFunction[oldState][c] = newState;
+          table.next[oldState][c] = newState;
         }
       }
     }
@@ -253,7 +566,8 @@ class AsmDFA {
      * or a special fail state if the transition does not exist.
      */
     State transition(State state, char nextChar) const {
-      return transitionFunction[state][nextChar];
+      return static_cast<State>(
+          transitionFunction.next[state][static_cast<unsigned char>(nextChar)]);
     }
 
     /* Checks whether the state returned by transition
@@ -265,7 +579,7 @@ class AsmDFA {
      * is an accepting state.
      */
     bool accept(State state) const {
-      return acceptingStates.count(state) > 0;
+      return (acceptingStates >> state) & 1;
     }
 
     /* Returns the starting state of the DFA
@@ -273,30 +587,87 @@ class AsmDFA {
     State start() const { return START; }
 };
 
-std::vector<Token> scan(const std::string &input) {
-  static AsmDFA theDFA;
+// All tables are constant-initialized, so there is no work to do at
+// startup and they live in read-only memory.
+constexpr AsmDFA::TransitionTable AsmDFA::transitionFunction =
+    AsmDFA::buildTransitionFunction();
+constexpr AsmDFA::KindTable AsmDFA::stateKinds = AsmDFA::buildStateKinds();
+constexpr AsmDFA::DigitTables AsmDFA::digitTables =
+    AsmDFA::buildDigitTables();
+
+static const AsmDFA theDFA{};
+
+void scan(const char *input, size_t size, std::vector<TokenView> &tokens) {
+  theDFA.simplifiedMaximalMunch(input, input, input + size, input + size, 1,
+      tokens);
+}
+
+void scan(const std::string &input, std::vector<TokenView> &tokens) {
+  scan(input.data(), input.size(), tokens);
+}
 
-  std::vector<Token> tokens = theDFA.simplifiedMaximalMunch(input);
+ProgramScanner::ProgramScanner(const char *input, size_t size,
+    Symbols *symbols):
+  input(input), end(input + size), lineStart(input), line(1),
+  symbols(symbols) {}
 
-  // We need to:
-  // * Throw exceptions for WORD tokens whose lexemes aren't ".word".
-  // * Remove WHITESPACE and COMMENT tokens entirely.
+bool ProgramScanner::scanLines(std::vector<TokenView> &tokens,
+    size_t maxLines) {
+  if (lineStart == end) {
+    return false;
+  }
 
-  std::vector<Token> newTokens;
+  for (size_t lines = 0; lines < maxLines && lineStart != end;
+      ++lines, ++line) {
+    const char *lineEnd = static_cast<const char *>(
+        memchr(lineStart, '\n', end - lineStart));
+    if (lineEnd == nullptr) {
+      lineEnd = end;
+    }
 
-  for (auto &token : tokens) {
-    if (token.getKind() == Token::WORD) {
-      if (token.getLexeme() == ".word") {
-        newTokens.push_back(token);
-      } else {
-        throw ScanningFailure("ERROR: DOTID token unrecognized: " +
-            token.getLexeme());
+    size_t lineTokens = tokens.size();
+    try {
+      theDFA.simplifiedMaximalMunch(input, lineStart, lineEnd, end, line,
+          tokens);
+    } catch (ScanningFailure &f) {
+      tokens.resize(lineTokens);
+      throw;
+    }
+
+    if (symbols != nullptr) {
+      for (size_t i = lineTokens; i < tokens.size(); ++i) {
+        TokenView &token = tokens[i];
+        if (token.kind == Token::ID) {
+          token.symbol = symbols->intern(input + token.offset, token.length);
+        } else if (token.kind == Token::LABEL) {
+          token.symbol = symbols->intern(input + token.offset,
+              token.length - 1);
+        }
       }
-    } else if (token.getKind() != Token::WHITESPACE
-        && token.getKind() != Token::Kind::COMMENT) {
-      newTokens.push_back(token);
     }
+    tokens.push_back(TokenView{Token::NEWLINE, line,
+        static_cast<uint32_t>(lineEnd - lineStart + 1), Symbols::noSymbol,
+        static_cast<size_t>(lineEnd - input), 0, 0});
+
+    lineStart = lineEnd == end ? end : lineEnd + 1;
+  }
+  return true;
+}
+
+void scanProgram(const char *input, size_t size,
+    std::vector<TokenView> &tokens, Symbols *symbols) {
+  ProgramScanner(input, size, symbols).scanLines(tokens, SIZE_MAX);
+}
+
+std::vector<Token> scan(const std::string &input) {
+  std::vector<TokenView> views;
+  scan(input, views);
+
+  std::vector<Token> tokens;
+  tokens.reserve(views.size());
+  for (auto &view : views) {
+    tokens.push_back(view.toToken(input.data()));
   }
 
-  return newTokens;
+  return tokens;
 }
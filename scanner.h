@@ -17,6 +17,7 @@
  */
 
 class Token;
+class Symbols;
 
 /* Scans a single line of input and produces a list of tokens.
  *
@@ -24,16 +25,81 @@ class Token;
  * ID: identifiers and keywords.
  * LABEL: labels (identifiers ending in a colon).
  * WORD: the special ".word" keyword.
+ * IMPORT: the ".import" directive of relocatable programs.
+ * EXPORT: the ".export" directive of relocatable programs.
+ * SPACE, FILL, INCBIN: the ".space", ".fill" and ".incbin" data directives.
  * COMMA: a comma.
  * LPAREN: a left parenthesis.
  * RPAREN: a right parenthesis.
  * INT: a signed or unsigned 32-bit integer written in decimal.
  * HEXINT: an unsigned 32-bit integer written in hexadecimal.
  * REG: a register between $0 and $31.
+ * STRING: text in double quotes, on one line.
+ *
+ * The values of INT, HEXINT and REG tokens are computed while scanning, and
+ * a ScanningFailure is thrown for any that lie outside the ranges above.
  */
 
 std::vector<Token> scan(const std::string &input);
 
+class TokenView;
+
+/* Scans size bytes of input starting at input, appending the tokens found
+ * to the end of tokens. The same kinds are produced as for scan above, but
+ * no lexemes are copied: each TokenView only records where its lexeme lies
+ * in input, so input must outlive the views. Reusing the same tokens vector
+ * across calls avoids any allocation once it has grown large enough.
+ */
+void scan(const char *input, size_t size, std::vector<TokenView> &tokens);
+void scan(const std::string &input, std::vector<TokenView> &tokens);
+
+/* Scans an entire program of size bytes at once, appending its tokens to
+ * tokens. Lines are split exactly as getline would split them, each line is
+ * scanned as by scan above, and a NEWLINE token is appended after the
+ * tokens of every line. Offsets are relative to input, and every view also
+ * records the (1-based) line and column its lexeme starts at.
+ *
+ * If symbols is given, every ID token's lexeme and every LABEL token's
+ * lexeme without its colon is interned there, and the id is stored in the
+ * view's symbol field.
+ *
+ * If a line fails to scan, tokens is left holding every line before it
+ * (each ending in NEWLINE) and the ScanningFailure is rethrown, so callers
+ * can still process those lines before reporting the error.
+ */
+void scanProgram(const char *input, size_t size,
+    std::vector<TokenView> &tokens, Symbols *symbols = nullptr);
+
+/* Scans a program like scanProgram, but a block of lines at a time, so
+ * that only one block's tokens need to be held at once.
+ */
+class ProgramScanner {
+    const char *input;
+    const char *end;
+    const char *lineStart;
+    uint32_t line;
+    Symbols *symbols;
+
+  public:
+    ProgramScanner(const char *input, size_t size, Symbols *symbols = nullptr);
+
+    /* Appends the tokens of up to maxLines more lines to tokens, exactly as
+     * scanProgram would. Returns false, appending nothing, once the whole
+     * input has been scanned. Failures are reported as for scanProgram.
+     */
+    bool scanLines(std::vector<TokenView> &tokens, size_t maxLines);
+
+    // The number of the next line to be scanned, which is the line that
+    // failed if scanLines has just thrown.
+    uint32_t nextLine() const { return line; }
+};
+
+/* Enables or disables the whitespace and comment fast paths used by all of
+ * the scan functions (enabled by default). Scanning produces the same
+ * tokens either way; this exists so the two can be compared.
+ */
+void setScanSkipping(bool enabled);
+
 /* A scanned token produced by the scanner.
  * The "kind" tells us what kind of token it is
  * while the "lexeme" tells us exactly what text
@@ -51,22 +117,33 @@ class Token {
       ID = 0,
       LABEL,
       WORD,
+      IMPORT,
+      EXPORT,
+      SPACE,
+      FILL,
+      INCBIN,
       COMMA,
       LPAREN,
       RPAREN,
       INT,
       HEXINT,
       REG,
+      STRING,
       WHITESPACE,
-      COMMENT
+      COMMENT,
+      NEWLINE
     };
 
   private:
     Kind kind;
     std::string lexeme;
+    int64_t value;
 
   public:
+    // Computes the value of INT, HEXINT and REG tokens from lexeme.
     Token(Kind kind, std::string lexeme);
+    // Uses a value the scanner has already computed.
+    Token(Kind kind, std::string lexeme, int64_t value);
 
     Kind getKind() const;
     const std::string &getLexeme() const;
@@ -77,6 +154,8 @@ class Token {
      * returns a long since the result may be either signed
      * or unsigned, and thus may lie anywhere in the range
      * -2147483648 .. 4294967295
+     *
+     * The value is computed when the token is created, so this is free.
      */
     int64_t toLong() const;
 
@@ -84,6 +163,28 @@ class Token {
 
 std::ostream &operator<<(std::ostream &out, const Token &tok);
 
+/* A token produced by the non-copying scan overloads. Rather than owning
+ * its lexeme, it stores the offset and length of the lexeme within the
+ * scanned input. For INT, HEXINT and REG tokens, value holds the same
+ * number Token::toLong would return. For ID and LABEL tokens from
+ * scanProgram, symbol holds the interned id of the name (or
+ * Symbols::noSymbol if no Symbols was given).
+ */
+class TokenView {
+  public:
+    Token::Kind kind;
+    uint32_t line;
+    uint32_t column;
+    uint32_t symbol;
+    size_t offset;
+    size_t length;
+    int64_t value;
+
+    // Builds the owning Token for this view; input must be the same
+    // buffer that was scanned.
+    Token toToken(const char *input) const;
+};
+
 /* An exception class thrown when an error is encountered while scanning.
  */
 class ScanningFailure {
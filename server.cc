@@ -0,0 +1,130 @@
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "server.h"
+#include "output.h"
+#include "scanner.h"
+
+AssemblerServer::AssemblerServer(const std::string &path, size_t threads,
+    bool incbin):
+  path(path), listener(-1), incbin(incbin), pool(threads) {
+  sockaddr_un address = socketAddress(path);
+  listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    socketFailure("create socket");
+  }
+
+  auto bindSocket = [&]() {
+    return bind(listener, reinterpret_cast<sockaddr *>(&address),
+      sizeof(address));
+  };
+  int result = bindSocket();
+  if (result < 0 && errno == EADDRINUSE) {
+    // A socket nobody is listening on was left behind by a server that
+    // died; one that is still in use is left alone
+    try {
+      close(connectToServer(path));
+      errno = EADDRINUSE;
+    } catch (ScanningFailure &f) {
+      unlink(path.c_str());
+      result = bindSocket();
+    }
+  }
+  if (result < 0 || listen(listener, SOMAXCONN) < 0) {
+    int error = errno;
+    close(listener);
+    errno = error;
+    socketFailure("listen on " + path);
+  }
+}
+
+AssemblerServer::~AssemblerServer() {
+  close(listener);
+  unlink(path.c_str());
+}
+
+void AssemblerServer::run() {
+  for (;;) {
+    int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      socketFailure("accept on " + path);
+    }
+    pool.submit([this, fd]() { serve(fd); });
+  }
+}
+
+void AssemblerServer::serve(int fd) {
+  std::unique_ptr<Assembler> assembler;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!idle.empty()) {
+      assembler = std::move(idle.back());
+      idle.pop_back();
+    }
+  }
+  if (!assembler) {
+    assembler.reset(new Assembler());
+  }
+
+  // Kept from one request to the next, like the Assembler
+  std::vector<char> source;
+  std::vector<unsigned char> response;
+  std::string text;
+
+  for (;;) {
+    unsigned char header[requestHeaderSize];
+    if (!receiveAll(fd, header, sizeof(header))) {
+      break;
+    }
+    AssemblerOptions options;
+    options.relocatable = (loadBigEndian(header) & 1) != 0;
+    options.incbin = incbin;
+    uint32_t relaxRegister = loadBigEndian(header + 4);
+    options.relaxRegister = relaxRegister == 0 ? -1 : relaxRegister;
+    uint32_t size = loadBigEndian(header + 8);
+    if (relaxRegister > 31 || size > maxSourceSize) {
+      break;
+    }
+    source.resize(size);
+    if (!receiveAll(fd, source.data(), size)) {
+      break;
+    }
+
+    assembler->setOptions(options);
+    bool ok = assembler->assemble(source.data(), size);
+    text.clear();
+    if (ok) {
+      text = assembler->listing();
+    }
+    else {
+      for (auto &diagnostic : assembler->diagnostics()) {
+        text += diagnostic.message + "\n";
+      }
+    }
+    static const std::vector<uint32_t> none;
+    const std::vector<uint32_t> &words = ok ? assembler->words() : none;
+
+    response.resize(responseHeaderSize + words.size() * 4 + text.size());
+    unsigned char *p = response.data();
+    storeBigEndian(p, ok ? 0 : 1);
+    storeBigEndian(p + 4, words.size());
+    storeBigEndian(p + 8, text.size());
+    p += responseHeaderSize;
+    for (uint32_t word : words) {
+      storeBigEndian(p, word);
+      p += 4;
+    }
+    memcpy(p, text.data(), text.size());
+    if (!sendAll(fd, response.data(), response.size())) {
+      break;
+    }
+  }
+  close(fd);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  idle.push_back(std::move(assembler));
+}
@@ -0,0 +1,46 @@
+#ifndef CS241_SERVER_H
+#define CS241_SERVER_H
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "assembler.h"
+#include "protocol.h"
+#include "threadpool.h"
+
+/* Serves assemble requests on a Unix domain socket. Each connection is
+ * handled by one of a pool of worker threads while it stays open, using an
+ * Assembler that is kept warm (its buffers allocated and its symbols table
+ * grown) for the next connection when it closes. Anyone who can connect
+ * would see what .incbin reads with the server's access to files, so
+ * unless the server allows it, .incbin is an error in requests.
+ */
+class AssemblerServer {
+    std::string path;
+    int listener;
+    bool incbin;                  // whether requests may use .incbin
+    ThreadPool pool;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Assembler>> idle;  // guarded by mutex
+
+    void serve(int fd);
+
+  public:
+    // Listens on a socket at path, replacing any stale one left there, with
+    // threads workers (one per hardware thread if 0), allowing .incbin if
+    // incbin. Throws ScanningFailure if it cannot.
+    AssemblerServer(const std::string &path, size_t threads = 0,
+      bool incbin = false);
+    // Stops listening and removes the socket.
+    ~AssemblerServer();
+
+    AssemblerServer(const AssemblerServer &) = delete;
+    AssemblerServer &operator=(const AssemblerServer &) = delete;
+
+    // Accepts and serves connections forever.
+    void run();
+};
+
+#endif
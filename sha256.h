@@ -0,0 +1,28 @@
+#ifndef CS241_SHA256_H
+#define CS241_SHA256_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/* Computes SHA-256 digests (FIPS 180-4) of data fed to it in pieces.
+ */
+class Sha256 {
+    uint32_t state[8];
+    unsigned char block[64];
+    size_t blockUsed;
+    uint64_t length;
+
+    void compress(const unsigned char *p);
+
+  public:
+    Sha256();
+
+    void update(const void *data, size_t size);
+    void update(const std::string &data);
+
+    // Returns the digest of everything fed so far, as 64 hex digits. The
+    // object must not be used again afterwards.
+    std::string hexDigest();
+};
+
+#endif
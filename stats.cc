@@ -0,0 +1,92 @@
+#include <sys/resource.h>
+#include <cstdlib>
+#include <new>
+#include "stats.h"
+
+namespace {
+
+// Counted by the replacement operator new below. Plain thread-locals, so
+// that counting costs an allocation no more than two increments.
+thread_local uint64_t allocationCount = 0;
+thread_local uint64_t allocationBytes = 0;
+
+uint64_t micros(const timespec &from, const timespec &to) {
+  return (to.tv_sec - from.tv_sec) * 1000000
+    + (to.tv_nsec - from.tv_nsec) / 1000;
+}
+
+} // namespace
+
+// The other forms of operator new and delete use these ones by default
+void *operator new(std::size_t size) {
+  ++allocationCount;
+  allocationBytes += size;
+  void *p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
+
+PhaseStats &PhaseStats::operator+=(const PhaseStats &other) {
+  wallMicros += other.wallMicros;
+  cpuMicros += other.cpuMicros;
+  allocations += other.allocations;
+  allocatedBytes += other.allocatedBytes;
+  return *this;
+}
+
+PhaseTimer::PhaseTimer(PhaseStats &stats): stats(stats), running(false) {
+  start();
+}
+
+PhaseTimer::~PhaseTimer() {
+  stop();
+}
+
+void PhaseTimer::start() {
+  if (!running) {
+    running = true;
+    allocations = allocationCount;
+    allocatedBytes = allocationBytes;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+  }
+}
+
+void PhaseTimer::stop() {
+  if (running) {
+    running = false;
+    timespec wallNow, cpuNow;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuNow);
+    clock_gettime(CLOCK_MONOTONIC, &wallNow);
+    stats.wallMicros += micros(wall, wallNow);
+    stats.cpuMicros += micros(cpu, cpuNow);
+    stats.allocations += allocationCount - allocations;
+    stats.allocatedBytes += allocationBytes - allocatedBytes;
+  }
+}
+
+uint64_t threadAllocations() {
+  return allocationCount;
+}
+
+uint64_t threadAllocatedBytes() {
+  return allocationBytes;
+}
+
+uint64_t peakResidentBytes() {
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0) {
+    return 0;
+  }
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+}
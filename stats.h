@@ -0,0 +1,48 @@
+#ifndef CS241_STATS_H
+#define CS241_STATS_H
+#include <cstdint>
+#include <ctime>
+
+/* Time and memory spent on one phase of some work. Times are summed over
+ * every thread that worked on the phase, so they can add up to more than
+ * the time that passed if several threads worked at once.
+ */
+struct PhaseStats {
+  uint64_t wallMicros = 0;          // elapsed time
+  uint64_t cpuMicros = 0;           // CPU time of the threads involved
+  uint64_t allocations = 0;         // calls to operator new
+  uint64_t allocatedBytes = 0;      // bytes they asked for
+
+  PhaseStats &operator+=(const PhaseStats &other);
+};
+
+/* Measures the calling thread while it runs, from construction (or start)
+ * to stop (or destruction), adding what it measures to a PhaseStats. It
+ * can be stopped and started again any number of times.
+ */
+class PhaseTimer {
+    PhaseStats &stats;
+    bool running;
+    timespec wall, cpu;
+    uint64_t allocations, allocatedBytes;
+
+  public:
+    explicit PhaseTimer(PhaseStats &stats);
+    ~PhaseTimer();
+
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+    void start();
+    void stop();
+};
+
+// The number of calls to operator new made by the calling thread so far,
+// and the bytes they asked for. Any program linking stats.o counts these.
+uint64_t threadAllocations();
+uint64_t threadAllocatedBytes();
+
+// The most memory the process has had resident at once, in bytes
+uint64_t peakResidentBytes();
+
+#endif
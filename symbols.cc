@@ -0,0 +1,86 @@
+#include <cstring>
+#include "symbols.h"
+
+const uint32_t Symbols::noSymbol;
+
+Symbols::Symbols(): starts(1, 0), slots(64, noSymbol) {}
+
+// FNV-1a; identifiers are short, so anything fancier doesn't pay off.
+uint32_t Symbols::hash(const char *name, size_t length) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    h = (h ^ static_cast<unsigned char>(name[i])) * 16777619u;
+  }
+  return h;
+}
+
+// Returns the slot holding name, or the empty slot where it would go.
+size_t Symbols::findSlot(const char *name, size_t length, uint32_t h) const {
+  size_t mask = slots.size() - 1;
+  for (size_t i = h & mask;; i = (i + 1) & mask) {
+    uint32_t id = slots[i];
+    if (id == noSymbol) {
+      return i;
+    }
+    if (hashes[id] == h && starts[id + 1] - starts[id] == length
+        && memcmp(names.data() + starts[id], name, length) == 0) {
+      return i;
+    }
+  }
+}
+
+// Doubles the hash table, keeping it at most half full.
+void Symbols::grow() {
+  std::vector<uint32_t> old(slots.size() * 2, noSymbol);
+  slots.swap(old);
+  size_t mask = slots.size() - 1;
+  for (uint32_t id : old) {
+    if (id != noSymbol) {
+      size_t i = hashes[id] & mask;
+      while (slots[i] != noSymbol) {
+        i = (i + 1) & mask;
+      }
+      slots[i] = id;
+    }
+  }
+}
+
+uint32_t Symbols::intern(const char *name, size_t length) {
+  uint32_t h = hash(name, length);
+  size_t slot = findSlot(name, length, h);
+  if (slots[slot] != noSymbol) {
+    return slots[slot];
+  }
+
+  uint32_t id = size();
+  names.append(name, length);
+  starts.push_back(names.size());
+  hashes.push_back(h);
+  slots[slot] = id;
+
+  if (size() * 2 > slots.size()) {
+    grow();
+  }
+  return id;
+}
+
+uint32_t Symbols::intern(const std::string &name) {
+  return intern(name.data(), name.size());
+}
+
+uint32_t Symbols::find(const char *name, size_t length) const {
+  return slots[findSlot(name, length, hash(name, length))];
+}
+
+uint32_t Symbols::size() const { return hashes.size(); }
+
+std::string Symbols::name(uint32_t id) const {
+  return names.substr(starts[id], starts[id + 1] - starts[id]);
+}
+
+void Symbols::clear() {
+  names.clear();
+  starts.assign(1, 0);
+  hashes.clear();
+  slots.assign(slots.size(), noSymbol);
+}
@@ -0,0 +1,49 @@
+#ifndef CS241_SYMBOLS_H
+#define CS241_SYMBOLS_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Interns identifier names, assigning each distinct name a dense 32-bit id
+ * starting from 0 in order of first appearance. Ids can be used to index
+ * flat arrays instead of looking names up in a map; name() recovers the
+ * text when it is needed, e.g. for error messages.
+ *
+ * Names are copied into a single growing buffer and found again through an
+ * open-addressed hash table, so interning a name that is already present
+ * does not allocate.
+ */
+class Symbols {
+    std::string names;              // every name, back to back
+    std::vector<uint32_t> starts;   // offset of name i in names (plus end)
+    std::vector<uint32_t> hashes;   // hash of name i
+    std::vector<uint32_t> slots;    // hash table of ids; empty is noSymbol
+
+  public:
+    static const uint32_t noSymbol = UINT32_MAX;
+
+    Symbols();
+
+    // Returns the id of the length bytes at name, adding it if necessary.
+    uint32_t intern(const char *name, size_t length);
+    uint32_t intern(const std::string &name);
+
+    // Returns the id of name, or noSymbol if it has never been interned.
+    uint32_t find(const char *name, size_t length) const;
+
+    // The number of distinct names interned so far.
+    uint32_t size() const;
+
+    std::string name(uint32_t id) const;
+
+    // Forgets every name, keeping the memory allocated for reuse.
+    void clear();
+
+  private:
+    static uint32_t hash(const char *name, size_t length);
+    size_t findSlot(const char *name, size_t length, uint32_t h) const;
+    void grow();
+};
+
+#endif
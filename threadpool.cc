@@ -0,0 +1,65 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(size_t threads): running(0), stopping(false) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    workers.emplace_back(&ThreadPool::work, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  taskReady.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    taskReady.wait(lock, [this] { return stopping || !tasks.empty(); });
+    if (tasks.empty()) {
+      return;
+    }
+
+    std::function<void()> task = std::move(tasks.front());
+    tasks.pop_front();
+    ++running;
+    lock.unlock();
+    task();
+    lock.lock();
+    --running;
+
+    if (tasks.empty() && running == 0) {
+      allDone.notify_all();
+    }
+  }
+}
+
+size_t ThreadPool::size() const { return workers.size(); }
+
+void ThreadPool::submit(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(std::move(task));
+  }
+  taskReady.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> lock(mutex);
+  allDone.wait(lock, [this] { return tasks.empty() && running == 0; });
+}
+
+void ThreadPool::parallelFor(size_t n, const std::function<void(size_t)> &job) {
+  for (size_t i = 0; i < n; ++i) {
+    submit([&job, i] { job(i); });
+  }
+  wait();
+}
@@ -0,0 +1,45 @@
+#ifndef CS241_THREADPOOL_H
+#define CS241_THREADPOOL_H
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* A fixed set of worker threads that run submitted tasks in the order they
+ * were submitted. Tasks must not throw.
+ */
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable taskReady;
+    std::condition_variable allDone;
+    size_t running;
+    bool stopping;
+
+    void work();
+
+  public:
+    // Starts threads workers, or one per hardware thread if threads is 0.
+    explicit ThreadPool(size_t threads = 0);
+    // Finishes every task already submitted, then stops the workers.
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t size() const;
+
+    void submit(std::function<void()> task);
+
+    // Blocks until every task submitted so far has finished.
+    void wait();
+
+    // Runs job(0), ..., job(n - 1) on the pool and waits for all of them.
+    void parallelFor(size_t n, const std::function<void(size_t)> &job);
+};
+
+#endif
@@ -0,0 +1,362 @@
+#include <cerrno>
+#include <cstring>
+#include "trace.h"
+#include "scanner.h"
+
+namespace {
+
+const char magic[] = "MIPSTRC1";
+const size_t magicSize = 8;
+
+// Sizes of the block headers
+const size_t headerSize = 8;
+
+// The largest block a reader accepts
+const uint32_t maxBlock = 64 << 20;
+
+int32_t unzigzag(uint32_t value) {
+  return static_cast<int32_t>(value >> 1 ^ (0 - (value & 1)));
+}
+
+uint32_t read32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, 4);
+  return value;
+}
+
+void putLittleEndian(unsigned char *p, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = value >> 8 * i;
+  }
+}
+
+uint32_t getLittleEndian(const unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+// Appends an LZ length extension: 255s then the remainder
+void putLength(std::vector<unsigned char> &out, size_t length) {
+  for (; length >= 255; length -= 255) {
+    out.push_back(255);
+  }
+  out.push_back(length);
+}
+
+/* Compresses size bytes from in onto the end of out, as sequences of a
+ * token (the number of literals in its top 4 bits and the match length
+ * minus 4 in its bottom 4, each 15 meaning an extension follows), the
+ * literals, then a 2-byte little-endian offset back to the match. The last
+ * sequence has only literals. Matches are found through a hash table of
+ * the last position of each 4 bytes, like LZ4.
+ */
+void compress(const unsigned char *in, size_t size,
+    std::vector<unsigned char> &out) {
+  const size_t minMatch = 4;
+  const int hashBits = 16;
+  std::vector<uint32_t> table(1 << hashBits);   // positions + 1, or 0
+  size_t anchor = 0;                             // the first literal
+  size_t p = 0;
+
+  auto putSequence = [&](size_t literals, size_t offset, size_t match) {
+    const size_t token = out.size();
+    out.push_back(0);
+    if (literals >= 15) {
+      putLength(out, literals - 15);
+    }
+    out.insert(out.end(), in + anchor, in + anchor + literals);
+    unsigned high = literals >= 15 ? 15 : literals, low = 0;
+    if (match != 0) {
+      out.push_back(offset);
+      out.push_back(offset >> 8);
+      low = match - minMatch >= 15 ? 15 : match - minMatch;
+      if (low == 15) {
+        putLength(out, match - minMatch - 15);
+      }
+    }
+    out[token] = high << 4 | low;
+  };
+
+  // Leave the last bytes as literals, so matches can be extended without
+  // checking for the end of the input every byte
+  if (size > 12) {
+    const size_t end = size - 12;
+    while (p < end) {
+      const uint32_t bytes = read32(in + p);
+      const uint32_t hash = bytes * 2654435761u >> (32 - hashBits);
+      const size_t candidate = table[hash];
+      table[hash] = p + 1;
+      if (candidate == 0 || p - (candidate - 1) > 65535
+          || read32(in + candidate - 1) != bytes) {
+        // Skip ahead faster through input that does not compress
+        p += 1 + ((p - anchor) >> 6);
+        continue;
+      }
+      const size_t match = candidate - 1;
+      size_t length = minMatch;
+      while (p + length < size - 5 && in[match + length] == in[p + length]) {
+        ++length;
+      }
+      putSequence(p - anchor, p - match, length);
+      p += length;
+      anchor = p;
+    }
+  }
+  putSequence(size - anchor, 0, 0);
+}
+
+// Decompresses size bytes from in into out, which must end up holding
+// exactly its size
+bool decompress(const unsigned char *in, size_t size,
+    std::vector<unsigned char> &out) {
+  const unsigned char *const end = in + size;
+  size_t filled = 0;
+
+  auto getLength = [&](size_t &length) {
+    unsigned char byte;
+    do {
+      if (in == end) {
+        return false;
+      }
+      byte = *in++;
+      length += byte;
+    } while (byte == 255);
+    return true;
+  };
+
+  while (in < end) {
+    const unsigned token = *in++;
+    size_t literals = token >> 4;
+    if (literals == 15 && !getLength(literals)) {
+      return false;
+    }
+    if (literals > static_cast<size_t>(end - in)
+        || literals > out.size() - filled) {
+      return false;
+    }
+    memcpy(&out[filled], in, literals);
+    in += literals;
+    filled += literals;
+    if (in == end) {
+      break;
+    }
+    if (end - in < 2) {
+      return false;
+    }
+    const size_t offset = in[0] | in[1] << 8;
+    in += 2;
+    size_t length = (token & 15) + 4;
+    if ((token & 15) == 15 && !getLength(length)) {
+      return false;
+    }
+    if (offset == 0 || offset > filled || length > out.size() - filled) {
+      return false;
+    }
+    // Byte by byte, since the match may overlap what it produces
+    for (size_t i = 0; i < length; ++i, ++filled) {
+      out[filled] = out[filled - offset];
+    }
+  }
+  return filled == out.size();
+}
+
+} // namespace
+
+TraceWriter::TraceWriter(const std::string &path):
+  file(nullptr), path(path), writer(1), current(0), out(nullptr),
+  limit(nullptr), open(false), jump(0), pc(0), expected(0), lastAddress(0),
+  run(0), traced(0), written(0) {
+  file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    throw ScanningFailure("ERROR: Cannot write " + path + ": "
+      + strerror(errno));
+  }
+  for (auto &buffer : buffers) {
+    buffer.reset(new unsigned char[blockSize]);
+  }
+  out = buffers[0].get();
+  limit = out + blockSize - maxRecord;
+  if (fwrite(magic, 1, magicSize, file) != magicSize) {
+    failure = "ERROR: Cannot write " + path + ": " + strerror(errno);
+  }
+  written = magicSize;
+}
+
+TraceWriter::~TraceWriter() {
+  if (file != nullptr) {
+    try {
+      finish();
+    } catch (ScanningFailure &f) {
+    }
+  }
+}
+
+void TraceWriter::closeInstruction() {
+  open = false;
+  if (jump != 0) {
+    putInstruction(0);
+  }
+  else if (++run == 32) {
+    putRun();
+  }
+}
+
+void TraceWriter::nextBlock() {
+  putRun();
+  // The other buffer may still be being written
+  writer.wait();
+  const unsigned char *data = buffers[current].get();
+  const size_t size = out - data;
+  writer.submit([this, data, size] { writeBlock(data, size); });
+  current ^= 1;
+  out = buffers[current].get();
+  limit = out + blockSize - maxRecord;
+  expected = 0;
+  lastAddress = 0;
+}
+
+void TraceWriter::writeBlock(const unsigned char *data, size_t size) {
+  if (!failure.empty()) {
+    return;
+  }
+  std::vector<unsigned char> block(headerSize);
+  compress(data, size, block);
+  if (block.size() - headerSize >= size) {
+    block.resize(headerSize);
+    block.insert(block.end(), data, data + size);
+  }
+  putLittleEndian(&block[0], size);
+  putLittleEndian(&block[4], block.size() - headerSize);
+  if (fwrite(block.data(), 1, block.size(), file) != block.size()) {
+    failure = "ERROR: Cannot write " + path + ": " + strerror(errno);
+  }
+  written += block.size();
+}
+
+void TraceWriter::finish() {
+  if (file == nullptr) {
+    return;
+  }
+  if (open) {
+    closeInstruction();
+  }
+  putRun();
+  writer.wait();
+  unsigned char *data = buffers[current].get();
+  if (out != data) {
+    writeBlock(data, out - data);
+  }
+  out = data;
+  writeBlock(data, 0);
+  if (fclose(file) != 0 && failure.empty()) {
+    failure = "ERROR: Cannot write " + path + ": " + strerror(errno);
+  }
+  file = nullptr;
+  if (!failure.empty()) {
+    throw ScanningFailure(failure);
+  }
+}
+
+TraceReader::TraceReader(const std::string &path):
+  file(nullptr), path(path), position(0), run(0), expected(0),
+  lastAddress(0), ended(false) {
+  file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    throw ScanningFailure("ERROR: Cannot read " + path + ": "
+      + strerror(errno));
+  }
+  char header[magicSize];
+  if (fread(header, 1, magicSize, file) != magicSize
+      || memcmp(header, magic, magicSize) != 0) {
+    fclose(file);
+    throw ScanningFailure("ERROR: " + path + " is not a trace");
+  }
+}
+
+TraceReader::~TraceReader() {
+  fclose(file);
+}
+
+bool TraceReader::readBlock() {
+  unsigned char header[headerSize];
+  if (fread(header, 1, headerSize, file) != headerSize) {
+    throw ScanningFailure("ERROR: Trace " + path + " is truncated");
+  }
+  const uint32_t size = getLittleEndian(header);
+  const uint32_t storedSize = getLittleEndian(header + 4);
+  if (size == 0) {
+    ended = true;
+    return false;
+  }
+  if (size > maxBlock || storedSize > size) {
+    throw ScanningFailure("ERROR: Trace " + path + " is corrupt");
+  }
+  stored.resize(storedSize);
+  raw.resize(size);
+  if (fread(stored.data(), 1, storedSize, file) != storedSize) {
+    throw ScanningFailure("ERROR: Trace " + path + " is truncated");
+  }
+  if (storedSize == size) {
+    raw.swap(stored);
+  }
+  else if (!decompress(stored.data(), storedSize, raw)) {
+    throw ScanningFailure("ERROR: Trace " + path + " is corrupt");
+  }
+  position = 0;
+  expected = 0;
+  lastAddress = 0;
+  return true;
+}
+
+uint32_t TraceReader::getVarint() {
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (position == raw.size()) {
+      break;
+    }
+    const unsigned char byte = raw[position++];
+    value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      return value;
+    }
+  }
+  throw ScanningFailure("ERROR: Trace " + path + " is corrupt");
+}
+
+bool TraceReader::next(TraceEvent &event) {
+  event.access = TraceEvent::NONE;
+  event.address = event.value = 0;
+  if (run != 0) {
+    --run;
+    event.pc = expected;
+    expected += 4;
+    return true;
+  }
+  if (ended) {
+    return false;
+  }
+  while (position == raw.size()) {
+    if (!readBlock()) {
+      return false;
+    }
+  }
+  const unsigned tag = raw[position++];
+  if ((tag & 7) == 0) {
+    run = tag >> 3;
+    event.pc = expected;
+    expected += 4;
+    return true;
+  }
+  if (tag & 1) {
+    const uint32_t words = tag >> 3 != 0 ? (tag >> 3) - 1 : getVarint();
+    expected += static_cast<uint32_t>(unzigzag(words)) * 4;
+  }
+  event.pc = expected;
+  expected += 4;
+  if (tag & 6) {
+    event.access = tag & 2 ? TraceEvent::LOAD : TraceEvent::STORE;
+    lastAddress += static_cast<uint32_t>(unzigzag(getVarint()));
+    event.address = lastAddress;
+    event.value = static_cast<uint32_t>(unzigzag(getVarint()));
+  }
+  return true;
+}
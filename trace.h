@@ -0,0 +1,195 @@
+#ifndef CS241_TRACE_H
+#define CS241_TRACE_H
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include "threadpool.h"
+
+/* Execution traces: the address of every instruction a machine runs, in
+ * order, along with the address and value of every word it loads or
+ * stores (including input and output).
+ *
+ * A trace file is the 8 bytes "MIPSTRC1" then a series of blocks, each a
+ * 4-byte raw size and a 4-byte stored size (little-endian) followed by the
+ * stored bytes, and last a block of raw size 0. Blocks are compressed with
+ * a byte-oriented LZ77 (like LZ4's block format), or stored raw if that
+ * does not make them smaller. Each block decodes on its own.
+ *
+ * The raw bytes are a series of records, each starting with a tag byte:
+ *   - a tag whose low 3 bits are 0 stands for (tag >> 3) + 1 instructions,
+ *     each just after the one before, that accessed no memory;
+ *   - otherwise it is one instruction. If bit 0 is set, its address is not
+ *     just after the one before: the difference in words, zigzag encoded,
+ *     is the top 5 bits of the tag minus 1, or a varint after the tag if
+ *     those are 0. If bit 1 or 2 is set, it loaded or stored a word; then
+ *     follow varints of the zigzag encoded difference between the address
+ *     and the last address accessed, and of the zigzag encoded value.
+ * At the start of each block, the next instruction is expected at address
+ * 0, and the last address accessed is taken to be 0.
+ */
+
+/* Writes a trace as the machine runs. It encodes on the calling thread
+ * into one buffer while a background thread compresses and writes the
+ * other.
+ */
+class TraceWriter {
+    enum { JUMP = 1, LOAD = 2, STORE = 4 };
+    static const size_t blockSize = 4 << 20;
+    static const size_t maxRecord = 32;     // more than an instruction needs
+
+    FILE *file;
+    std::string path;
+    ThreadPool writer;                    // one thread
+    std::unique_ptr<unsigned char[]> buffers[2];
+    int current;                          // the buffer being filled
+    unsigned char *out;
+    unsigned char *limit;                 // where to move to the other buffer
+    bool open;                            // whether pc has been recorded
+    int32_t jump;                         // words from where pc was expected
+    uint32_t pc;
+    uint32_t expected;                    // the address after the last pc
+    uint32_t lastAddress;
+    unsigned run;                         // sequential instructions to record
+    uint64_t traced;
+    uint64_t written;
+    std::string failure;                  // why writing failed, if it did
+
+    void putVarint(uint32_t value);
+    void putRun();
+    void putInstruction(unsigned kind);
+    void putAccess(unsigned kind, uint32_t address, uint32_t value);
+    void closeInstruction();
+    void nextBlock();
+    void writeBlock(const unsigned char *data, size_t size);
+
+  public:
+    explicit TraceWriter(const std::string &path);
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter &) = delete;
+    TraceWriter &operator=(const TraceWriter &) = delete;
+
+    // Records that the instruction at address is running. Called for every
+    // instruction, so it does as little as it can.
+    void instruction(uint32_t address) {
+      if (open) {
+        // Mostly the last instruction just lengthens a run
+        if (jump == 0 && run < 31) {
+          ++run;
+        }
+        else {
+          closeInstruction();
+        }
+      }
+      if (out > limit) {
+        nextBlock();
+      }
+      open = true;
+      jump = static_cast<int32_t>(address - expected) / 4;
+      pc = address;
+      expected = address + 4;
+      ++traced;
+    }
+
+    // Records that the instruction just recorded loaded or stored value at
+    // address
+    void load(uint32_t address, uint32_t value) {
+      putAccess(LOAD, address, value);
+    }
+    void store(uint32_t address, uint32_t value) {
+      putAccess(STORE, address, value);
+    }
+
+    // Writes the rest of the trace and closes the file
+    void finish();
+
+    uint64_t instructions() const { return traced; }
+
+    // The size of the file, once finished
+    uint64_t bytes() const { return written; }
+};
+
+// Most instructions call these, so they are inline too
+
+inline uint32_t traceZigzag(int32_t value) {
+  return static_cast<uint32_t>(value) << 1
+    ^ static_cast<uint32_t>(value >> 31);
+}
+
+inline void TraceWriter::putVarint(uint32_t value) {
+  while (value >= 0x80) {
+    *out++ = value | 0x80;
+    value >>= 7;
+  }
+  *out++ = value;
+}
+
+inline void TraceWriter::putRun() {
+  if (run != 0) {
+    *out++ = (run - 1) << 3;
+    run = 0;
+  }
+}
+
+inline void TraceWriter::putInstruction(unsigned kind) {
+  putRun();
+  if (jump == 0) {
+    *out++ = kind;
+    return;
+  }
+  const uint32_t words = traceZigzag(jump);
+  if (words < 31) {
+    *out++ = kind | JUMP | (words + 1) << 3;
+  }
+  else {
+    *out++ = kind | JUMP;
+    putVarint(words);
+  }
+}
+
+inline void TraceWriter::putAccess(unsigned kind, uint32_t address,
+    uint32_t value) {
+  putInstruction(kind);
+  putVarint(traceZigzag(static_cast<int32_t>(address - lastAddress)));
+  putVarint(traceZigzag(static_cast<int32_t>(value)));
+  lastAddress = address;
+  open = false;
+}
+
+// An instruction from a trace
+struct TraceEvent {
+  enum Access : uint8_t { NONE, LOAD, STORE };
+  uint32_t pc;
+  Access access;
+  uint32_t address, value;    // of the word loaded or stored, if any
+};
+
+// Reads a trace back, an instruction at a time
+class TraceReader {
+    FILE *file;
+    std::string path;
+    std::vector<unsigned char> stored, raw;
+    size_t position;            // in raw
+    unsigned run;               // instructions left of a run
+    uint32_t expected;
+    uint32_t lastAddress;
+    bool ended;
+
+    bool readBlock();
+    uint32_t getVarint();
+
+  public:
+    explicit TraceReader(const std::string &path);
+    ~TraceReader();
+
+    TraceReader(const TraceReader &) = delete;
+    TraceReader &operator=(const TraceReader &) = delete;
+
+    // Reads the next instruction into event, returning false at the end
+    bool next(TraceEvent &event);
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include "scanner.h"
+#include "trace.h"
+using namespace std;
+
+/*
+ * Reads back a trace written by emu --trace (see trace.h).
+ *
+ * Usage: tracedump [--summary | --output] [--skip n] [--count n]
+ *   [--pc a[-b]] [--address a[-b]] [--loads] [--stores] trace
+ * Prints the instructions of the trace, one per line: its position in the
+ * trace and its address, then for a load or store "lw" or "sw", the
+ * address and the value. The options choose which are printed: --skip
+ * passes over the first n instructions of the trace and --count stops
+ * after n more, --pc and --address keep only instructions at addresses, or
+ * accessing addresses, from a to b (inclusive), and --loads and --stores
+ * keep only loads or stores (or both, if both are given).
+ *
+ * --summary prints how many of the chosen instructions there were, of
+ * each kind, instead. --output replays what the program wrote to standard
+ * output instead.
+ */
+
+// An inclusive range of addresses
+struct Range {
+  uint32_t low = 0, high = 0xffffffff;
+
+  bool contains(uint32_t address) const {
+    return low <= address && address <= high;
+  }
+};
+
+uint64_t parseNumber(const string &text) {
+  char *end;
+  unsigned long long value = strtoull(text.c_str(), &end, 0);
+  if (text.empty() || *end != '\0') {
+    throw ScanningFailure("ERROR: Invalid number " + text);
+  }
+  return value;
+}
+
+Range parseRange(const string &text) {
+  Range range;
+  size_t dash = text.find('-');
+  range.low = parseNumber(text.substr(0, dash));
+  range.high = dash == string::npos ? range.low
+    : parseNumber(text.substr(dash + 1));
+  return range;
+}
+
+string hex(uint32_t word) {
+  char text[11];
+  snprintf(text, sizeof(text), "0x%08x", word);
+  return text;
+}
+
+int usage(const char *name) {
+  cerr << "Usage: " << name << " [--summary | --output] [--skip n]"
+    << " [--count n] [--pc a[-b]] [--address a[-b]] [--loads] [--stores]"
+    << " trace" << endl;
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = nullptr;
+  bool summary = false, output = false;
+  bool loads = false, stores = false;
+  uint64_t skip = 0, count = UINT64_MAX;
+  Range pcs, addresses;
+  bool byAddress = false;
+
+  try {
+    for (int i = 1; i < argc; ++i) {
+      string arg = argv[i];
+      bool hasValue = i + 1 < argc;
+      if (arg == "--summary") {
+        summary = true;
+      }
+      else if (arg == "--output") {
+        output = true;
+      }
+      else if (arg == "--loads") {
+        loads = true;
+      }
+      else if (arg == "--stores") {
+        stores = true;
+      }
+      else if (arg == "--skip" && hasValue) {
+        skip = parseNumber(argv[++i]);
+      }
+      else if (arg == "--count" && hasValue) {
+        count = parseNumber(argv[++i]);
+      }
+      else if (arg == "--pc" && hasValue) {
+        pcs = parseRange(argv[++i]);
+      }
+      else if (arg == "--address" && hasValue) {
+        addresses = parseRange(argv[++i]);
+        byAddress = true;
+      }
+      else if (path == nullptr && !arg.empty() && arg[0] != '-') {
+        path = argv[i];
+      }
+      else {
+        return usage(argv[0]);
+      }
+    }
+    if (path == nullptr || (summary && output)) {
+      return usage(argv[0]);
+    }
+
+    TraceReader reader(path);
+    TraceEvent event;
+    uint64_t index = 0;
+    uint64_t chosen = 0, loaded = 0, stored = 0, inputs = 0, outputs = 0;
+    for (; index < skip && reader.next(event); ++index) {
+    }
+    for (; index - skip < count && reader.next(event); ++index) {
+      const bool load = event.access == TraceEvent::LOAD;
+      const bool store = event.access == TraceEvent::STORE;
+      if (!pcs.contains(event.pc)
+          || ((loads || stores) && !(loads && load) && !(stores && store))
+          || (byAddress && (event.access == TraceEvent::NONE
+            || !addresses.contains(event.address)))) {
+        continue;
+      }
+      ++chosen;
+      if (output) {
+        if (store && event.address == 0xffff000c) {
+          putchar_unlocked(event.value & 0xff);
+        }
+      }
+      else if (summary) {
+        loaded += load;
+        stored += store;
+        inputs += load && event.address == 0xffff0004;
+        outputs += store && event.address == 0xffff000c;
+      }
+      else {
+        cout << index << " " << hex(event.pc);
+        if (event.access != TraceEvent::NONE) {
+          cout << (load ? " lw " : " sw ") << hex(event.address) << " "
+            << hex(event.value);
+        }
+        cout << "\n";
+      }
+    }
+    if (summary) {
+      cout << "instructions " << chosen << "\n"
+        << "loads " << loaded << "\n"
+        << "stores " << stored << "\n"
+        << "inputs " << inputs << "\n"
+        << "outputs " << outputs << "\n";
+    }
+    cout.flush();
+  }
+  catch (ScanningFailure &f) {
+    cerr << f.what() << endl;
+    return 1;
+  }
+  return 0;
+}